@@ -40,17 +40,26 @@ __FBSDID("$FreeBSD$");
 #include <sys/systm.h>
 #include <sys/malloc.h>
 #include <sys/bus.h>
+#include <sys/conf.h>
+#include <sys/fcntl.h>
 #include <sys/rman.h>
 #include <sys/endian.h>
 #include <sys/firmware.h>
 #include <sys/limits.h>
 #include <sys/module.h>
+#include <sys/pcpu.h>
 #include <sys/queue.h>
+#include <sys/sdt.h>
 #include <sys/taskqueue.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+
+#include <vm/uma.h>
 
 #include <machine/bus.h>
 #include <machine/resource.h>
 #include <machine/clock.h>
+#include <machine/cpu.h>
 
 #include <dev/pci/pcireg.h>
 #include <dev/pci/pcivar.h>
@@ -81,6 +90,41 @@ __FBSDID("$FreeBSD$");
 #ifdef IWN_4965
 #include "if_iwnreg4965.h"
 #endif
+
+/* DTrace probes (iwn:::), active in kernels with KDTRACE_HOOKS. */
+SDT_PROVIDER_DEFINE(iwn);
+SDT_PROBE_DEFINE4(iwn, , tx, data, data, "int", "int", "int", "uint32_t");
+SDT_PROBE_DEFINE4(iwn, , tx, done, done, "int", "int", "int", "int");
+SDT_PROBE_DEFINE3(iwn, , tx, ampdu__done, ampdu-done, "int", "int", "int");
+SDT_PROBE_DEFINE3(iwn, , rx, done, done, "int", "int", "uint32_t");
+SDT_PROBE_DEFINE3(iwn, , rx, compressed__ba, compressed-ba, "int", "int",
+    "int");
+SDT_PROBE_DEFINE4(iwn, , cmd, submit, submit, "int", "int", "int", "int");
+SDT_PROBE_DEFINE2(iwn, , cmd, done, done, "int", "int");
+SDT_PROBE_DEFINE2(iwn, , scan, start, start, "int", "uint32_t");
+SDT_PROBE_DEFINE2(iwn, , scan, stop, stop, "int", "int");
+SDT_PROBE_DEFINE(iwn, , intr, entry, entry);
+SDT_PROBE_DEFINE2(iwn, , intr, exit, exit, "uint32_t", "uint32_t");
+
+/*
+ * What each thermal throttling state restricts.  Only the power save
+ * level, which limits how long the radio is on, applies to chips
+ * without advanced thermal throttling.
+ */
+static const struct iwn_tt_restrict {
+	int		pslevel;	/* minimum power save level */
+	uint8_t		ampdu_max;	/* frames per A-MPDU */
+	uint16_t	ampdu_limit;	/* usec per A-MPDU */
+	int		siso;		/* single stream rates only */
+	int		noagg;		/* refuse new BA sessions */
+} iwn_tt_restrict[] = {
+	[IWN_TT_NORMAL] = { 0, 64, 4000, 0, 0 },
+	[IWN_TT_LIGHT]	= { 2, 32, 3000, 0, 0 },
+	[IWN_TT_MEDIUM]	= { 4, 16, 2000, 1, 0 },
+	[IWN_TT_HEAVY]	= { 5,  8, 1000, 1, 1 },
+	[IWN_TT_CTKILL]	= { 5,  8, 1000, 1, 1 },
+};
+
 struct iwn_ident {
 	uint16_t	vendor;
 	uint16_t	device;
@@ -139,6 +183,20 @@ static int	iwn_attach(device_t);
 static int	iwn5000_attach(struct iwn_softc *, uint16_t);
 static void	iwn_radiotap_attach(struct iwn_softc *);
 static void	iwn_sysctlattach(struct iwn_softc *);
+static void	iwn_sysctl_hist(struct sysctl_ctx_list *, struct sysctl_oid *,
+		    const char *, const char *, uint64_t *);
+static int	iwn_sysctl_txq_saved(SYSCTL_HANDLER_ARGS);
+static void	iwn_sysctl_rings(struct iwn_softc *, struct sysctl_ctx_list *,
+		    struct sysctl_oid *);
+static int	iwn_sysctl_fw_cached(SYSCTL_HANDLER_ARGS);
+static int	iwn_sysctl_calib_cache(SYSCTL_HANDLER_ARGS);
+static int	iwn_sysctl_eeprom(SYSCTL_HANDLER_ARGS);
+static int	iwn_sysctl_trace(SYSCTL_HANDLER_ARGS);
+static int	iwn_sysctl_trace_buf(SYSCTL_HANDLER_ARGS);
+static int	iwn_sysctl_crashdump(SYSCTL_HANDLER_ARGS);
+static int	iwn_sysctl_fwstat(SYSCTL_HANDLER_ARGS);
+static void	iwn_trace_log(struct iwn_softc *, int, uint32_t, uint32_t,
+		    uint32_t);
 static struct ieee80211vap *iwn_vap_create(struct ieee80211com *,
 		    const char [IFNAMSIZ], int, enum ieee80211_opmode, int,
 		    const uint8_t [IEEE80211_ADDR_LEN],
@@ -151,7 +209,9 @@ static int	iwn_resume(device_t);
 static int	iwn_nic_lock(struct iwn_softc *);
 static int	iwn_eeprom_lock(struct iwn_softc *);
 static int	iwn_init_otprom(struct iwn_softc *);
+static int	iwn_read_prom_word(struct iwn_softc *, uint32_t, uint16_t *);
 static int	iwn_read_prom_data(struct iwn_softc *, uint32_t, void *, int);
+static void	iwn_read_prom_shadow(struct iwn_softc *);
 static void	iwn_dma_map_addr(void *, bus_dma_segment_t *, int, int);
 static int	iwn_dma_contig_alloc(struct iwn_softc *, struct iwn_dma_info *,
 		    void **, bus_size_t, bus_size_t);
@@ -171,6 +231,8 @@ static int	iwn_alloc_tx_ring(struct iwn_softc *, struct iwn_tx_ring *,
 		    int);
 static void	iwn_reset_tx_ring(struct iwn_softc *, struct iwn_tx_ring *);
 static void	iwn_free_tx_ring(struct iwn_softc *, struct iwn_tx_ring *);
+static void	iwn_txq_check_idle(struct iwn_softc *, int);
+static void	iwn_txq_free_idle(void *, int);
 static void	iwn5000_ict_reset(struct iwn_softc *);
 static int	iwn_read_eeprom(struct iwn_softc *,
 		    uint8_t macaddr[IEEE80211_ADDR_LEN]);
@@ -185,8 +247,10 @@ static int	iwn_setregdomain(struct ieee80211com *,
 		    struct ieee80211_regdomain *, int,
 		    struct ieee80211_channel[]);
 static void	iwn_read_eeprom_enhinfo(struct iwn_softc *);
+static int	iwn_node_ctor(void *, int, void *, int);
 static struct ieee80211_node *iwn_node_alloc(struct ieee80211vap *,
 		    const uint8_t mac[IEEE80211_ADDR_LEN]);
+static void	iwn_node_free(struct ieee80211_node *);
 static void	iwn_newassoc(struct ieee80211_node *, int);
 static int	iwn_media_change(struct ifnet *);
 static int	iwn_newstate(struct ieee80211vap *, enum ieee80211_state, int);
@@ -199,6 +263,8 @@ static void	iwn_rx_compressed_ba(struct iwn_softc *, struct iwn_rx_desc *,
 		    struct iwn_rx_data *);
 static void	iwn5000_rx_calib_results(struct iwn_softc *,
 		    struct iwn_rx_desc *, struct iwn_rx_data *);
+static void	iwn_fwstats_update(struct iwn_softc *,
+		    const struct iwn_stats *, int);
 static void	iwn_rx_statistics(struct iwn_softc *, struct iwn_rx_desc *,
 		    struct iwn_rx_data *);
 static void	iwn5000_tx_done(struct iwn_softc *, struct iwn_rx_desc *,
@@ -210,7 +276,17 @@ static void	iwn_cmd_done(struct iwn_softc *, struct iwn_rx_desc *);
 static void	iwn_notif_intr(struct iwn_softc *);
 static void	iwn_wakeup_intr(struct iwn_softc *);
 static void	iwn_rftoggle_intr(struct iwn_softc *);
+static void	iwn_crash_capture(struct iwn_softc *);
 static void	iwn_fatal_intr(struct iwn_softc *);
+static u_int	iwn_evtlog_cap(struct iwn_softc *,
+		    const struct iwn_fw_evtlog_hdr *, u_int *);
+static int	iwn_evtlog_poll(struct iwn_softc *);
+static void	iwn_evtlog_timeout(void *);
+static d_open_t		iwn_evtlog_open;
+static d_close_t	iwn_evtlog_close;
+static d_read_t		iwn_evtlog_read;
+static u_int	iwn_ict_drain(struct iwn_softc *, uint32_t *);
+static void	iwn_ict_rewind(struct iwn_softc *);
 static void	iwn_intr(void *);
 static void	iwn5000_update_sched(struct iwn_softc *, int, int, uint8_t,
 		    uint16_t);
@@ -226,6 +302,7 @@ static int	iwn_raw_xmit(struct ieee80211_node *, struct mbuf *,
 		    const struct ieee80211_bpf_params *);
 static void	iwn_start(struct ifnet *);
 static void	iwn_start_locked(struct ifnet *);
+static void	iwn_tx_restart(struct iwn_softc *);
 static void	iwn_watchdog(void *);
 static int	iwn_ioctl(struct ifnet *, u_long, caddr_t);
 static int	iwn_cmd(struct iwn_softc *, int, const void *, int, int);
@@ -239,6 +316,11 @@ static void	iwn_update_mcast(struct ifnet *);
 static void	iwn_set_led(struct iwn_softc *, uint8_t, uint8_t, uint8_t,
 		    uint8_t);
 static int	iwn_set_critical_temp(struct iwn_softc *);
+static int	iwn_tt_state(struct iwn_softc *, int);
+static void	iwn_tt_update(struct iwn_softc *, int);
+static void	iwn_ct_kill_enter(struct iwn_softc *);
+static int	iwn_ct_kill_exit(struct iwn_softc *);
+static void	iwn_ct_kill_exit_timeout(void *);
 static int	iwn_set_timing(struct iwn_softc *, struct ieee80211_node *);
 static int	iwn5000_set_txpower(struct iwn_softc *,
 		    struct ieee80211_channel *, int);
@@ -246,10 +328,14 @@ static int	iwn5000_get_rssi(struct iwn_softc *, struct iwn_rx_stat *);
 static int	iwn_get_noise(const struct iwn_rx_general_stats *);
 static int	iwn5000_get_temperature(struct iwn_softc *);
 static int	iwn_init_sensitivity(struct iwn_softc *);
+static int	iwn_gain_calib_ok(struct iwn_softc *);
 static void	iwn_collect_noise(struct iwn_softc *,
 		    const struct iwn_rx_general_stats *);
 static int	iwn5000_init_gains(struct iwn_softc *);
 static int	iwn5000_set_gains(struct iwn_softc *);
+static uint32_t	iwn_swmax_push(struct iwn_swmax *, uint32_t, u_int);
+static int	iwn_calib_inc(uint32_t *, uint32_t, uint32_t);
+static int	iwn_calib_dec(uint32_t *, uint32_t, uint32_t);
 static void	iwn_tune_sensitivity(struct iwn_softc *,
 		    const struct iwn_rx_stats *);
 static int	iwn_send_sensitivity(struct iwn_softc *);
@@ -257,8 +343,14 @@ static int	iwn_set_pslevel(struct iwn_softc *, int, int, int);
 static int	iwn_send_btcoex(struct iwn_softc *);
 static int	iwn_send_advanced_btcoex(struct iwn_softc *);
 static int	iwn5000_runtime_calib(struct iwn_softc *);
+static int	iwn_rxon_full_required(struct iwn_softc *,
+		    const struct iwn_rxon *, const struct iwn_rxon *);
+static int	iwn_rxon_commit(struct iwn_softc *, int, int, int *);
 static int	iwn_config(struct iwn_softc *);
 static uint8_t	*ieee80211_add_ssid(uint8_t *, const uint8_t *, u_int);
+static int	iwn_bgscan_busy(struct iwn_softc *);
+static void	iwn_bgscan_setup(struct iwn_softc *, struct iwn_scan_hdr *,
+		    struct ieee80211_node *);
 static int	iwn_scan(struct iwn_softc *);
 static int	iwn_auth(struct iwn_softc *, struct ieee80211vap *vap);
 static int	iwn_run(struct iwn_softc *, struct ieee80211vap *vap);
@@ -280,11 +372,16 @@ static void	iwn5000_ampdu_tx_stop(struct iwn_softc *, int,
 		    uint8_t, uint16_t);
 static int	iwn5000_query_calibration(struct iwn_softc *);
 static int	iwn5000_send_calibration(struct iwn_softc *);
+static void	iwn_calib_flush(struct iwn_softc *);
+static void	iwn_calib_cache_check(struct iwn_softc *);
 static int	iwn5000_send_wimax_coex(struct iwn_softc *);
 static int	iwn5000_crystal_calib(struct iwn_softc *);
 static int	iwn5000_temp_offset_calib(struct iwn_softc *);
 static int	iwn5000_temp_offset_calibv2(struct iwn_softc *);
 static int	iwn5000_post_alive(struct iwn_softc *);
+static int	iwn5000_fw_dma_kick(struct iwn_softc *, uint32_t, bus_addr_t,
+		    int);
+static int	iwn5000_fw_dma_wait(struct iwn_softc *);
 static int	iwn5000_load_firmware_section(struct iwn_softc *, uint32_t,
 		    const uint8_t *, int);
 static int	iwn5000_load_firmware(struct iwn_softc *);
@@ -293,6 +390,7 @@ static int	iwn_read_firmware_leg(struct iwn_softc *,
 static int	iwn_read_firmware_tlv(struct iwn_softc *,
 		    struct iwn_fw_info *, uint16_t);
 static int	iwn_read_firmware(struct iwn_softc *);
+static void	iwn_release_firmware(struct iwn_softc *);
 static int	iwn_clock_wait(struct iwn_softc *);
 static int	iwn_apm_init(struct iwn_softc *);
 static void	iwn_apm_stop_master(struct iwn_softc *);
@@ -303,6 +401,7 @@ static int	iwn_hw_init(struct iwn_softc *);
 static void	iwn_hw_stop(struct iwn_softc *);
 static void	iwn_radio_on(void *, int);
 static void	iwn_radio_off(void *, int);
+static int	iwn_bringup(struct iwn_softc *);
 static void	iwn_init_locked(struct iwn_softc *);
 static void	iwn_init(void *);
 static void	iwn_stop_locked(struct iwn_softc *);
@@ -313,9 +412,18 @@ static void	iwn_set_channel(struct ieee80211com *);
 static void	iwn_scan_curchan(struct ieee80211_scan_state *, unsigned long);
 static void	iwn_scan_mindwell(struct ieee80211_scan_state *);
 static void	iwn_hw_reset(void *, int);
+static void	iwn_restart_ampdu(struct iwn_softc *, struct ieee80211_node *);
+static void	iwn_fw_restart(void *, int);
 #ifdef	IWN_DEBUG
 static char	*iwn_get_csr_string(int);
 static void	iwn_debug_register(struct iwn_softc *);
+static uint32_t	iwn_reg_read(struct iwn_softc *, bus_size_t, int);
+static void	iwn_reg_write(struct iwn_softc *, bus_size_t, uint32_t, int);
+static void	iwn_reg_write_1(struct iwn_softc *, bus_size_t, uint8_t, int);
+static void	iwn_regtrace_log(struct iwn_softc *, int, uint32_t, uint32_t,
+		    int);
+static int	iwn_sysctl_regtrace(SYSCTL_HANDLER_ARGS);
+static int	iwn_sysctl_regtrace_buf(SYSCTL_HANDLER_ARGS);
 static void	iwn_print_rate(struct iwn_softc *, uint32_t);
 #endif
 static int iwn_config_specific(struct iwn_softc *,uint16_t);
@@ -357,8 +465,13 @@ enum {
 	IWN_DEBUG_ANY		= 0xffffffff
 };
 
+static const char *iwn_regpath_names[IWN_REGPATH_MAX] = {
+	"other", "intr", "tx_data", "init", "post_alive", "stop", "calib",
+	"eeprom"
+};
+
 #define DPRINTF(sc, m, fmt, ...) do {			\
-	if ((sc->sc_debug & (m))== (m))				\
+	if (__predict_false((sc->sc_debug & (m)) == (m)))	\
 		printf(fmt, __VA_ARGS__);		\
 } while (0)
 
@@ -422,6 +535,129 @@ iwn_intr_str(uint8_t cmd)
 #define DPRINTF(sc, m, fmt, ...) do { (void) sc; } while (0)
 #endif
 
+/*
+ * Record a binary event.  Compiled into all kernels: when tracing is off
+ * this is a single, predicted-not-taken test.
+ */
+#define IWN_TRACE(sc, id, a0, a1, a2) do {				\
+	if (__predict_false((sc)->sc_trace != NULL))			\
+		iwn_trace_log((sc), (id), (a0), (a1), (a2));		\
+} while (0)
+
+/*
+ * Firmware statistics published under dev.iwn.N.stats.  Counters are
+ * accumulated into 64-bit totals; gauges report the last value.
+ */
+static const struct iwn_fwstat {
+	const char	*group;
+	const char	*name;
+	uint16_t	off;
+	uint8_t		counter;
+} iwn_fwstats[] = {
+#define C(g, f, n)	{ g, n, offsetof(struct iwn_stats, f), 1 }
+#define G(g, f, n)	{ g, n, offsetof(struct iwn_stats, f), 0 }
+#define PHY(g, p)							\
+	C(g, p.ina, "ina"),						\
+	C(g, p.fina, "fina"),						\
+	C(g, p.bad_plcp, "bad_plcp"),					\
+	C(g, p.bad_crc32, "bad_crc32"),					\
+	C(g, p.overrun, "overrun"),					\
+	C(g, p.eoverrun, "eoverrun"),					\
+	C(g, p.good_crc32, "good_crc32"),				\
+	C(g, p.fa, "false_alarms"),					\
+	C(g, p.bad_fina_sync, "bad_fina_sync"),				\
+	C(g, p.sfd_timeout, "sfd_timeout"),				\
+	C(g, p.fina_timeout, "fina_timeout"),				\
+	C(g, p.no_rts_ack, "no_rts_ack"),				\
+	C(g, p.rxe_limit, "rxe_limit"),					\
+	C(g, p.ack, "ack"),						\
+	C(g, p.cts, "cts"),						\
+	C(g, p.ba_resp, "ba_resp"),					\
+	C(g, p.dsp_kill, "dsp_kill"),					\
+	C(g, p.bad_mh, "bad_mh"),					\
+	C(g, p.rssi_sum, "rssi_sum")
+	PHY("rx_ofdm", rx.ofdm),
+	PHY("rx_cck", rx.cck),
+#undef PHY
+	C("rx_general", rx.general.bad_cts, "bad_cts"),
+	C("rx_general", rx.general.bad_ack, "bad_ack"),
+	C("rx_general", rx.general.not_bss, "not_bss"),
+	C("rx_general", rx.general.filtered, "filtered"),
+	C("rx_general", rx.general.bad_chan, "bad_chan"),
+	C("rx_general", rx.general.beacons, "beacons"),
+	C("rx_general", rx.general.missed_beacons, "missed_beacons"),
+	C("rx_general", rx.general.adc_saturated, "adc_saturated"),
+	C("rx_general", rx.general.ina_searched, "ina_searched"),
+	G("rx_general", rx.general.noise[0], "noise_a"),
+	G("rx_general", rx.general.noise[1], "noise_b"),
+	G("rx_general", rx.general.noise[2], "noise_c"),
+	G("rx_general", rx.general.flags, "flags"),
+	G("rx_general", rx.general.load, "load"),
+	C("rx_general", rx.general.fa, "dsp_false_alarms"),
+	G("rx_general", rx.general.rssi[0], "rssi_a"),
+	G("rx_general", rx.general.rssi[1], "rssi_b"),
+	G("rx_general", rx.general.rssi[2], "rssi_c"),
+	G("rx_general", rx.general.energy[0], "energy_a"),
+	G("rx_general", rx.general.energy[1], "energy_b"),
+	G("rx_general", rx.general.energy[2], "energy_c"),
+	C("rx_ht", rx.ht.bad_plcp, "bad_plcp"),
+	C("rx_ht", rx.ht.overrun, "overrun"),
+	C("rx_ht", rx.ht.eoverrun, "eoverrun"),
+	C("rx_ht", rx.ht.good_crc32, "good_crc32"),
+	C("rx_ht", rx.ht.bad_crc32, "bad_crc32"),
+	C("rx_ht", rx.ht.bad_mh, "bad_mh"),
+	C("rx_ht", rx.ht.good_ampdu_crc32, "good_ampdu_crc32"),
+	C("rx_ht", rx.ht.ampdu, "ampdu"),
+	C("rx_ht", rx.ht.fragment, "fragment"),
+	C("tx", tx.preamble, "preamble"),
+	C("tx", tx.rx_detected, "rx_detected"),
+	C("tx", tx.bt_defer, "bt_defer"),
+	C("tx", tx.bt_kill, "bt_kill"),
+	C("tx", tx.short_len, "short_len"),
+	C("tx", tx.cts_timeout, "cts_timeout"),
+	C("tx", tx.ack_timeout, "ack_timeout"),
+	C("tx", tx.exp_ack, "exp_ack"),
+	C("tx", tx.ack, "ack"),
+	C("tx", tx.msdu, "msdu"),
+	C("tx", tx.busrt_err1, "burst_err1"),
+	C("tx", tx.burst_err2, "burst_err2"),
+	C("tx", tx.cts_collision, "cts_collision"),
+	C("tx", tx.ack_collision, "ack_collision"),
+	C("tx", tx.ba_timeout, "ba_timeout"),
+	C("tx", tx.ba_resched, "ba_resched"),
+	C("tx", tx.query_ampdu, "query_ampdu"),
+	C("tx", tx.query, "query"),
+	C("tx", tx.query_ampdu_frag, "query_ampdu_frag"),
+	C("tx", tx.query_mismatch, "query_mismatch"),
+	C("tx", tx.not_ready, "not_ready"),
+	C("tx", tx.underrun, "underrun"),
+	C("tx", tx.bt_ht_kill, "bt_ht_kill"),
+	C("tx", tx.rx_ba_resp, "rx_ba_resp"),
+	G("general", general.temp, "temp"),
+	G("general", general.temp_m, "temp_m"),
+	C("general", general.burst_check, "burst_check"),
+	C("general", general.burst, "burst"),
+	C("general", general.sleep, "sleep"),
+	C("general", general.slot_out, "slot_out"),
+	C("general", general.slot_idle, "slot_idle"),
+	G("general", general.ttl_tstamp, "ttl_tstamp"),
+	C("general", general.tx_ant_a, "tx_ant_a"),
+	C("general", general.tx_ant_b, "tx_ant_b"),
+	C("general", general.exec, "exec"),
+	C("general", general.probe, "probe"),
+	C("general", general.rx_enabled, "rx_enabled"),
+#undef G
+#undef C
+};
+
+static struct cdevsw iwn_evtlog_cdevsw = {
+	.d_version =	D_VERSION,
+	.d_open =	iwn_evtlog_open,
+	.d_close =	iwn_evtlog_close,
+	.d_read =	iwn_evtlog_read,
+	.d_name =	"iwn_evtlog",
+};
+
 static device_method_t iwn_methods[] = {
 	/* Device interface */
 	DEVMETHOD(device_probe,		iwn_probe),
@@ -440,7 +676,30 @@ static driver_t iwn_driver = {
 };
 static devclass_t iwn_devclass;
 
-DRIVER_MODULE(iwn, pci, iwn_driver, iwn_devclass, 0, 0);
+/*
+ * Nodes come from a zone of our own rather than M_80211_NODE: stations
+ * churn quickly in hostap/IBSS mode and while scanning, and the zone
+ * keeps per-CPU caches and shows up in vmstat -z as "iwn_node".
+ */
+static uma_zone_t iwn_node_zone;
+
+static int
+iwn_modevent(module_t mod, int type, void *data)
+{
+	switch (type) {
+	case MOD_LOAD:
+		iwn_node_zone = uma_zcreate("iwn_node",
+		    sizeof (struct iwn_node), iwn_node_ctor, NULL, NULL, NULL,
+		    UMA_ALIGN_PTR, 0);
+		return 0;
+	case MOD_UNLOAD:
+		uma_zdestroy(iwn_node_zone);
+		return 0;
+	}
+	return EOPNOTSUPP;
+}
+
+DRIVER_MODULE(iwn, pci, iwn_driver, iwn_devclass, iwn_modevent, 0);
 
 MODULE_VERSION(iwn, 1);
 
@@ -472,7 +731,7 @@ iwn_attach(device_t dev)
 	struct ieee80211com *ic;
 	struct ifnet *ifp;
 	uint32_t reg;
-	int i, error, result;
+	int i, error, opath, result;
 	uint8_t macaddr[IEEE80211_ADDR_LEN];
 
 	sc->desired_pwrsave_level = IWN_POWERSAVE_LVL_DEFAULT;
@@ -542,6 +801,8 @@ iwn_attach(device_t dev)
 	}
 
 	IWN_LOCK_INIT(sc);
+	IWN_TX_LOCK_INIT(sc);
+	IWN_RX_LOCK_INIT(sc);
 
 	/* Read hardware revision and attach. */
 	sc->hw_type = (IWN_READ(sc, IWN_HW_REV) >> IWN_HW_REV_TYPE_SHIFT)
@@ -604,8 +865,15 @@ iwn_attach(device_t dev)
 		goto fail;
 	}
 
-	/* Allocate TX rings (16 on 4965AGN, 20 on >=5000). */
+	/*
+	 * Allocate TX rings (16 on 4965AGN, 20 on >=5000).  Aggregation
+	 * rings are allocated on the first ADDBA request that needs them.
+	 */
 	for (i = 0; i < sc->ntxqs; i++) {
+		sc->txq[i].qid = i;
+		mtx_init(&sc->txq[i].mtx, "iwn txq", NULL, MTX_DEF);
+		if (i >= sc->firstaggqueue)
+			continue;
 		if ((error = iwn_alloc_tx_ring(sc, &sc->txq[i], i)) != 0) {
 			device_printf(dev,
 			    "could not allocate TX ring %d, error %d\n", i,
@@ -657,7 +925,12 @@ iwn_attach(device_t dev)
 	}
 
 	/* Read MAC address, channels, etc from EEPROM. */
-	if ((error = iwn_read_eeprom(sc, macaddr)) != 0) {
+	IWN_LOCK(sc);
+	opath = iwn_regpath_enter(sc, IWN_REGPATH_EEPROM);
+	error = iwn_read_eeprom(sc, macaddr);
+	iwn_regpath_leave(sc, opath);
+	IWN_UNLOCK(sc);
+	if (error != 0) {
 		device_printf(dev, "could not read EEPROM, error %d\n",
 		    error);
 		goto fail;
@@ -732,6 +1005,7 @@ iwn_attach(device_t dev)
 	ic->ic_vap_delete = iwn_vap_delete;
 	ic->ic_raw_xmit = iwn_raw_xmit;
 	ic->ic_node_alloc = iwn_node_alloc;
+	ic->ic_node_free = iwn_node_free;
 	sc->sc_ampdu_rx_start = ic->ic_ampdu_rx_start;
 	ic->ic_ampdu_rx_start = iwn_ampdu_rx_start;
 	sc->sc_ampdu_rx_stop = ic->ic_ampdu_rx_stop;
@@ -758,19 +1032,30 @@ iwn_attach(device_t dev)
 	sc->sc_led.led_cur_time = 0;
 	sc->sc_led.led_last_time = 0;
 
-
+	sc->bgscan_maxout = IWN_BGSCAN_MAX_OUT_TIME;
+	sc->bgscan_suspend = IWN_BGSCAN_SUSPEND_TIME;
+	sc->bgscan_busythr = IWN_BGSCAN_BUSY_THRESHOLD;
 
 	iwn_radiotap_attach(sc);
 
 	callout_init_mtx(&sc->calib_to, &sc->sc_mtx, 0);
 	callout_init_mtx(&sc->watchdog_to, &sc->sc_mtx, 0);
 	callout_init_mtx(&sc->ct_kill_exit_to, &sc->sc_mtx, 0);
+	callout_init_mtx(&sc->evtlog_to, &sc->sc_mtx, 0);
+	sc->crash = malloc(sizeof (*sc->crash), M_DEVBUF, M_WAITOK | M_ZERO);
+	sc->evtlog_interval = IWN_EVTLOG_INTERVAL;
 	TASK_INIT(&sc->sc_reinit_task, 0, iwn_hw_reset, sc);
+	TASK_INIT(&sc->sc_restart_task, 0, iwn_fw_restart, sc);
 	TASK_INIT(&sc->sc_radioon_task, 0, iwn_radio_on, sc);
 	TASK_INIT(&sc->sc_radiooff_task, 0, iwn_radio_off, sc);
+	TASK_INIT(&sc->sc_txqfree_task, 0, iwn_txq_free_idle, sc);
 
 	iwn_sysctlattach(sc);
 
+	sc->sc_evtdev = make_dev(&iwn_evtlog_cdevsw, device_get_unit(dev),
+	    UID_ROOT, GID_WHEEL, 0600, "%s.evtlog", device_get_nameunit(dev));
+	sc->sc_evtdev->si_drv1 = sc;
+
 	/*
 	 * Hook our interrupt after all initialization is complete.
 	 */
@@ -830,6 +1115,8 @@ iwn5000_attach(struct iwn_softc *sc, uint16_t pid)
 	sc->fw_data_maxsz = IWN5000_FW_DATA_MAXSZ;
 	sc->fwsz = IWN5000_FWSZ;
 	sc->sched_txfact_addr = IWN5000_SCHED_TXFACT;
+	sc->sched_ctx_off = IWN5000_SCHED_CTX_OFF;
+	sc->sched_ctx_len = IWN5000_SCHED_CTX_LEN;
 	sc->reset_noise_gain = IWN5000_PHY_CALIB_RESET_NOISE_GAIN;
 	sc->noise_gain = IWN5000_PHY_CALIB_NOISE_GAIN;
 
@@ -860,16 +1147,607 @@ iwn_radiotap_attach(struct iwn_softc *sc)
 static void
 iwn_sysctlattach(struct iwn_softc *sc)
 {
-#ifdef	IWN_DEBUG
 	struct sysctl_ctx_list *ctx = device_get_sysctl_ctx(sc->sc_dev);
 	struct sysctl_oid *tree = device_get_sysctl_tree(sc->sc_dev);
+	struct sysctl_oid *stats, *group;
+	u_int n;
+#ifdef	IWN_DEBUG
+	struct sysctl_oid *regs, *node;
+	int i;
+#endif
 
+#ifdef	IWN_DEBUG
 	SYSCTL_ADD_INT(ctx, SYSCTL_CHILDREN(tree), OID_AUTO,
 	    "debug", CTLFLAG_RW, &sc->sc_debug, sc->sc_debug,
 		"control debugging printfs");
+	SYSCTL_ADD_PROC(ctx, SYSCTL_CHILDREN(tree), OID_AUTO,
+	    "regtrace", CTLTYPE_INT | CTLFLAG_RW, sc, 0,
+	    iwn_sysctl_regtrace, "I", "trace register accesses");
+	SYSCTL_ADD_PROC(ctx, SYSCTL_CHILDREN(tree), OID_AUTO,
+	    "regtrace_buf", CTLTYPE_OPAQUE | CTLFLAG_RD, sc, 0,
+	    iwn_sysctl_regtrace_buf, "S,iwn_regtrace_ent",
+	    "register access trace, oldest first");
+	regs = SYSCTL_ADD_NODE(ctx, SYSCTL_CHILDREN(tree), OID_AUTO,
+	    "regstats", CTLFLAG_RD, NULL, "register accesses per code path");
+	for (i = 0; i < IWN_REGPATH_MAX; i++) {
+		node = SYSCTL_ADD_NODE(ctx, SYSCTL_CHILDREN(regs), OID_AUTO,
+		    iwn_regpath_names[i], CTLFLAG_RD, NULL, "");
+		SYSCTL_ADD_UQUAD(ctx, SYSCTL_CHILDREN(node), OID_AUTO,
+		    "reads", CTLFLAG_RD, &sc->regstat[i].reads,
+		    "MMIO reads");
+		SYSCTL_ADD_UQUAD(ctx, SYSCTL_CHILDREN(node), OID_AUTO,
+		    "writes", CTLFLAG_RD, &sc->regstat[i].writes,
+		    "MMIO writes");
+		SYSCTL_ADD_UQUAD(ctx, SYSCTL_CHILDREN(node), OID_AUTO,
+		    "read_cycles", CTLFLAG_RD, &sc->regstat[i].read_cycles,
+		    "CPU cycles spent in MMIO reads");
+		SYSCTL_ADD_UQUAD(ctx, SYSCTL_CHILDREN(node), OID_AUTO,
+		    "prph", CTLFLAG_RD, &sc->regstat[i].prph,
+		    "periphery register accesses");
+		SYSCTL_ADD_UQUAD(ctx, SYSCTL_CHILDREN(node), OID_AUTO,
+		    "mem", CTLFLAG_RD, &sc->regstat[i].mem,
+		    "SRAM word accesses");
+	}
 #endif
+	SYSCTL_ADD_INT(ctx, SYSCTL_CHILDREN(tree), OID_AUTO,
+	    "bgscan_maxout", CTLFLAG_RW, &sc->bgscan_maxout, 0,
+	    "max time off the home channel during background scan (ms)");
+	SYSCTL_ADD_INT(ctx, SYSCTL_CHILDREN(tree), OID_AUTO,
+	    "bgscan_suspend", CTLFLAG_RW, &sc->bgscan_suspend, 0,
+	    "time back on the home channel between scan dwells (ms)");
+	SYSCTL_ADD_INT(ctx, SYSCTL_CHILDREN(tree), OID_AUTO,
+	    "bgscan_busythr", CTLFLAG_RW, &sc->bgscan_busythr, 0,
+	    "pending TX frames above which background scan is deferred");
+	SYSCTL_ADD_UINT(ctx, SYSCTL_CHILDREN(tree), OID_AUTO,
+	    "bgscan_cmds", CTLFLAG_RD, &sc->bgscan_cmds, 0,
+	    "background scan commands sent");
+	SYSCTL_ADD_UINT(ctx, SYSCTL_CHILDREN(tree), OID_AUTO,
+	    "bgscan_deferred", CTLFLAG_RD, &sc->bgscan_deferred, 0,
+	    "background scans deferred because of traffic");
+	SYSCTL_ADD_UINT(ctx, SYSCTL_CHILDREN(tree), OID_AUTO,
+	    "rxon_full", CTLFLAG_RD, &sc->rxon_full_cnt, 0,
+	    "full RXON commands sent");
+	SYSCTL_ADD_UINT(ctx, SYSCTL_CHILDREN(tree), OID_AUTO,
+	    "rxon_assoc", CTLFLAG_RD, &sc->rxon_assoc_cnt, 0,
+	    "RXON_ASSOC commands sent instead of a full RXON");
+	SYSCTL_ADD_UINT(ctx, SYSCTL_CHILDREN(tree), OID_AUTO,
+	    "rxon_skipped", CTLFLAG_RD, &sc->rxon_skip_cnt, 0,
+	    "RXON commits skipped because nothing changed");
+	SYSCTL_ADD_PROC(ctx, SYSCTL_CHILDREN(tree), OID_AUTO,
+	    "fw_cached", CTLTYPE_INT | CTLFLAG_RW, sc, 0,
+	    iwn_sysctl_fw_cached, "I",
+	    "parsed firmware image is resident (write 0 to release it)");
+	SYSCTL_ADD_UINT(ctx, SYSCTL_CHILDREN(tree), OID_AUTO,
+	    "fw_loads", CTLFLAG_RD, &sc->fw_loads, 0,
+	    "firmware images read from the filesystem");
+	SYSCTL_ADD_UINT(ctx, SYSCTL_CHILDREN(tree), OID_AUTO,
+	    "fw_cache_hits", CTLFLAG_RD, &sc->fw_cache_hits, 0,
+	    "initializations served from the cached firmware image");
+	SYSCTL_ADD_UINT(ctx, SYSCTL_CHILDREN(tree), OID_AUTO,
+	    "fw_restarts", CTLFLAG_RD, &sc->fw_restarts, 0,
+	    "firmware errors recovered by an in-place restart");
+	SYSCTL_ADD_UINT(ctx, SYSCTL_CHILDREN(tree), OID_AUTO,
+	    "fw_restart_fails", CTLFLAG_RD, &sc->fw_restart_fails, 0,
+	    "in-place restarts that fell back to a full reset");
+	SYSCTL_ADD_UINT(ctx, SYSCTL_CHILDREN(tree), OID_AUTO,
+	    "fw_restart_ms", CTLFLAG_RD, &sc->fw_restart_ms, 0,
+	    "duration of the last in-place restart in milliseconds");
+	SYSCTL_ADD_PROC(ctx, SYSCTL_CHILDREN(tree), OID_AUTO,
+	    "calib_cache", CTLTYPE_OPAQUE | CTLFLAG_RW, sc, 0,
+	    iwn_sysctl_calib_cache, "S,iwn_calib_blob",
+	    "saved INIT firmware calibration results");
+	SYSCTL_ADD_UINT(ctx, SYSCTL_CHILDREN(tree), OID_AUTO,
+	    "calib_reused", CTLFLAG_RD, &sc->calib_reused, 0,
+	    "initializations that skipped the INIT firmware boot");
+	SYSCTL_ADD_UINT(ctx, SYSCTL_CHILDREN(tree), OID_AUTO,
+	    "calib_stale", CTLFLAG_RD, &sc->calib_stale, 0,
+	    "cached calibrations discarded as stale");
+	SYSCTL_ADD_UINT(ctx, SYSCTL_CHILDREN(tree), OID_AUTO,
+	    "nic_wakes", CTLFLAG_RD, &sc->nic_wakes, 0,
+	    "NIC access requests that had to wake the MAC");
+	SYSCTL_ADD_UINT(ctx, SYSCTL_CHILDREN(tree), OID_AUTO,
+	    "nic_nested", CTLFLAG_RD, &sc->nic_nested, 0,
+	    "NIC access requests served while already awake");
+	SYSCTL_ADD_UINT(ctx, SYSCTL_CHILDREN(tree), OID_AUTO,
+	    "nic_spins", CTLFLAG_RD, &sc->nic_spins, 0,
+	    "10us polls spent waiting for the MAC to wake up");
+	SYSCTL_ADD_UINT(ctx, SYSCTL_CHILDREN(tree), OID_AUTO,
+	    "nic_timeouts", CTLFLAG_RD, &sc->nic_timeouts, 0,
+	    "NIC access requests that timed out");
+	SYSCTL_ADD_UINT(ctx, SYSCTL_CHILDREN(tree), OID_AUTO,
+	    "nic_maxwait", CTLFLAG_RW, &sc->nic_maxwait, 0,
+	    "worst-case MAC wake latency in usec (write 0 to reset)");
+	SYSCTL_ADD_PROC(ctx, SYSCTL_CHILDREN(tree), OID_AUTO,
+	    "eeprom", CTLTYPE_OPAQUE | CTLFLAG_RD, sc, 0,
+	    iwn_sysctl_eeprom, "S,iwn_eeprom", "EEPROM/OTPROM image");
+	SYSCTL_ADD_UINT(ctx, SYSCTL_CHILDREN(tree), OID_AUTO,
+	    "eeprom_hits", CTLFLAG_RD, &sc->eeprom_shadow_hits, 0,
+	    "ROM reads served from the RAM shadow");
+	SYSCTL_ADD_PROC(ctx, SYSCTL_CHILDREN(tree), OID_AUTO,
+	    "trace", CTLTYPE_INT | CTLFLAG_RW, sc, 0,
+	    iwn_sysctl_trace, "I", "record RX/TX events in the trace ring");
+	SYSCTL_ADD_PROC(ctx, SYSCTL_CHILDREN(tree), OID_AUTO,
+	    "trace_buf", CTLTYPE_OPAQUE | CTLFLAG_RD, sc, 0,
+	    iwn_sysctl_trace_buf, "S,iwn_trace_ent",
+	    "binary event trace, oldest first");
+	SYSCTL_ADD_INT(ctx, SYSCTL_CHILDREN(tree), OID_AUTO,
+	    "evtlog_interval", CTLFLAG_RW, &sc->evtlog_interval, 0,
+	    "msec between firmware event log polls");
+	SYSCTL_ADD_UQUAD(ctx, SYSCTL_CHILDREN(tree), OID_AUTO,
+	    "evtlog_events", CTLFLAG_RD, &sc->evtlog_events,
+	    "firmware event log entries collected");
+	SYSCTL_ADD_UQUAD(ctx, SYSCTL_CHILDREN(tree), OID_AUTO,
+	    "evtlog_lost", CTLFLAG_RD, &sc->evtlog_lost,
+	    "firmware event log entries overwritten or dropped");
+	SYSCTL_ADD_UINT(ctx, SYSCTL_CHILDREN(tree), OID_AUTO,
+	    "crashes", CTLFLAG_RD, &sc->crashes, 0,
+	    "firmware errors seen");
+	SYSCTL_ADD_INT(ctx, SYSCTL_CHILDREN(tree), OID_AUTO,
+	    "tt_state", CTLFLAG_RD, &sc->tt_state, 0,
+	    "thermal throttling state (0 none, 1-3 light-heavy, 4 CT kill)");
+	SYSCTL_ADD_UINT(ctx, SYSCTL_CHILDREN(tree), OID_AUTO,
+	    "tt_transitions", CTLFLAG_RD, &sc->tt_transitions, 0,
+	    "thermal throttling state changes");
+	SYSCTL_ADD_UINT(ctx, SYSCTL_CHILDREN(tree), OID_AUTO,
+	    "ct_kills", CTLFLAG_RD, &sc->ct_kills, 0,
+	    "times the radio was stopped at critical temperature");
+	SYSCTL_ADD_PROC(ctx, SYSCTL_CHILDREN(tree), OID_AUTO,
+	    "crashdump", CTLTYPE_OPAQUE | CTLFLAG_RD, sc, 0,
+	    iwn_sysctl_crashdump, "S,iwn_crashdump",
+	    "snapshot taken on the last firmware error");
+
+	iwn_sysctl_rings(sc, ctx, tree);
+
+	stats = SYSCTL_ADD_NODE(ctx, SYSCTL_CHILDREN(tree), OID_AUTO,
+	    "stats", CTLFLAG_RD, NULL, "firmware statistics");
+	SYSCTL_ADD_INT(ctx, SYSCTL_CHILDREN(stats), OID_AUTO,
+	    "clear_on_read", CTLFLAG_RW, &sc->fwstats_clear, 0,
+	    "have the firmware clear its counters on each statistics request");
+	group = NULL;
+	for (n = 0; n < nitems(iwn_fwstats); n++) {
+		if (group == NULL ||
+		    strcmp(iwn_fwstats[n].group, iwn_fwstats[n - 1].group) != 0)
+			group = SYSCTL_ADD_NODE(ctx, SYSCTL_CHILDREN(stats),
+			    OID_AUTO, iwn_fwstats[n].group, CTLFLAG_RD, NULL,
+			    "");
+		SYSCTL_ADD_PROC(ctx, SYSCTL_CHILDREN(group), OID_AUTO,
+		    iwn_fwstats[n].name, CTLTYPE_U64 | CTLFLAG_RD, sc,
+		    n, iwn_sysctl_fwstat, "QU",
+		    iwn_fwstats[n].counter ? "total" : "last value");
+	}
+}
+
+/*
+ * Report one firmware statistic.  With clear_on_read set, the counter
+ * restarts from zero and the firmware is asked to reset its own; a walk
+ * of the whole tree issues a single request since none is sent while
+ * one is pending.
+ */
+static int
+iwn_sysctl_fwstat(SYSCTL_HANDLER_ARGS)
+{
+	struct iwn_softc *sc = arg1;
+	struct ifnet *ifp = sc->sc_ifp;
+	const struct iwn_fwstat *fs = &iwn_fwstats[arg2];
+	uint64_t val;
+
+	IWN_LOCK(sc);
+	val = sc->fwstats[fs->off / 4];
+	if (sc->fwstats_clear) {
+		if (fs->counter)
+			sc->fwstats[fs->off / 4] = 0;
+		if (!sc->fwstats_clear_pending &&
+		    (ifp->if_drv_flags & IFF_DRV_RUNNING) &&
+		    iwn_set_statistics_request(sc, true, true, 1) == 0) {
+			sc->fwstats_clear_pending = 1;
+			sc->fwstats_clear_seq = sc->fwstats_reqs;
+		}
+	}
+	IWN_UNLOCK(sc);
+	return sysctl_handle_64(oidp, &val, 0, req);
+}
+
+static const char *iwn_ring_hist_names[IWN_RING_HIST] = {
+	"0", "1", "2_3", "4_7", "8_15", "16_31", "32_63", "64_127", "128_up"
+};
+
+static void
+iwn_sysctl_hist(struct sysctl_ctx_list *ctx, struct sysctl_oid *parent,
+    const char *name, const char *descr, uint64_t *hist)
+{
+	struct sysctl_oid *node;
+	int i;
+
+	node = SYSCTL_ADD_NODE(ctx, SYSCTL_CHILDREN(parent), OID_AUTO,
+	    name, CTLFLAG_RD, NULL, descr);
+	for (i = 0; i < IWN_RING_HIST; i++)
+		SYSCTL_ADD_UQUAD(ctx, SYSCTL_CHILDREN(node), OID_AUTO,
+		    iwn_ring_hist_names[i], CTLFLAG_RD, &hist[i], "");
+}
+
+/*
+ * Each TX ring holds IWN_TX_RING_COUNT descriptors and command slots in
+ * DMA memory (about 67KB); report what the unallocated ones don't use.
+ */
+static int
+iwn_sysctl_txq_saved(SYSCTL_HANDLER_ARGS)
+{
+	struct iwn_softc *sc = arg1;
+	int qid, val = 0;
+
+	for (qid = sc->firstaggqueue; qid < sc->ntxqs; qid++)
+		if (sc->txq[qid].desc == NULL)
+			val += IWN_TX_RING_COUNT * (sizeof (struct iwn_tx_desc) +
+			    sizeof (struct iwn_tx_cmd));
+	return sysctl_handle_int(oidp, &val, 0, req);
+}
+
+/*
+ * Per-ring TX and RX telemetry, to help tune IWN_TX_RING_LOMARK/HIMARK
+ * and interrupt coalescing.
+ */
+static void
+iwn_sysctl_rings(struct iwn_softc *sc, struct sysctl_ctx_list *ctx,
+    struct sysctl_oid *tree)
+{
+	struct sysctl_oid *txq, *node;
+	struct iwn_tx_ring *ring;
+	char name[8];
+	int qid;
+
+	txq = SYSCTL_ADD_NODE(ctx, SYSCTL_CHILDREN(tree), OID_AUTO,
+	    "txq", CTLFLAG_RD, NULL, "TX rings");
+	SYSCTL_ADD_UINT(ctx, SYSCTL_CHILDREN(txq), OID_AUTO,
+	    "agg_allocs", CTLFLAG_RD, &sc->txq_allocs, 0,
+	    "aggregation rings allocated on demand");
+	SYSCTL_ADD_UINT(ctx, SYSCTL_CHILDREN(txq), OID_AUTO,
+	    "agg_frees", CTLFLAG_RD, &sc->txq_frees, 0,
+	    "idle aggregation rings freed");
+	SYSCTL_ADD_PROC(ctx, SYSCTL_CHILDREN(txq), OID_AUTO,
+	    "agg_saved", CTLTYPE_INT | CTLFLAG_RD, sc, 0,
+	    iwn_sysctl_txq_saved, "I",
+	    "DMA memory not held by unallocated aggregation rings (bytes)");
+	for (qid = 0; qid < sc->ntxqs; qid++) {
+		ring = &sc->txq[qid];
+		snprintf(name, sizeof name, "%d", qid);
+		node = SYSCTL_ADD_NODE(ctx, SYSCTL_CHILDREN(txq), OID_AUTO,
+		    name, CTLFLAG_RD, NULL, "");
+		SYSCTL_ADD_INT(ctx, SYSCTL_CHILDREN(node), OID_AUTO,
+		    "cur_queued", CTLFLAG_RD, &ring->queued, 0,
+		    "frames currently queued");
+		SYSCTL_ADD_UQUAD(ctx, SYSCTL_CHILDREN(node), OID_AUTO,
+		    "queued", CTLFLAG_RD, &ring->st_queued,
+		    "frames queued");
+		SYSCTL_ADD_UQUAD(ctx, SYSCTL_CHILDREN(node), OID_AUTO,
+		    "completed", CTLFLAG_RD, &ring->st_done,
+		    "frames completed");
+		SYSCTL_ADD_INT(ctx, SYSCTL_CHILDREN(node), OID_AUTO,
+		    "hiwat", CTLFLAG_RW, &ring->st_hiwat, 0,
+		    "most frames ever queued (write 0 to reset)");
+		SYSCTL_ADD_UINT(ctx, SYSCTL_CHILDREN(node), OID_AUTO,
+		    "full", CTLFLAG_RD, &ring->st_full, 0,
+		    "times the ring went above the high mark");
+		SYSCTL_ADD_UQUAD(ctx, SYSCTL_CHILDREN(node), OID_AUTO,
+		    "full_ticks", CTLFLAG_RD, &ring->st_full_ticks,
+		    "ticks spent marked full, from going above the high mark "
+		    "until dropping below the low mark");
+		iwn_sysctl_hist(ctx, node, "occupancy",
+		    "frames already queued when enqueueing", ring->st_occ);
+		iwn_sysctl_hist(ctx, node, "reclaim",
+		    "frames reclaimed per completion", ring->st_reclaim);
+	}
+
+	node = SYSCTL_ADD_NODE(ctx, SYSCTL_CHILDREN(tree), OID_AUTO,
+	    "rxq", CTLFLAG_RD, NULL, "RX ring");
+	SYSCTL_ADD_UQUAD(ctx, SYSCTL_CHILDREN(node), OID_AUTO,
+	    "descriptors", CTLFLAG_RD, &sc->rxq.st_desc,
+	    "descriptors processed");
+	SYSCTL_ADD_UINT(ctx, SYSCTL_CHILDREN(node), OID_AUTO,
+	    "full", CTLFLAG_RD, &sc->rxq.st_full, 0,
+	    "interrupts that found the ring full");
+	SYSCTL_ADD_UINT(ctx, SYSCTL_CHILDREN(node), OID_AUTO,
+	    "nombuf", CTLFLAG_RD, &sc->rxq.st_nombuf, 0,
+	    "RX buffer allocation failures");
+	iwn_sysctl_hist(ctx, node, "batch",
+	    "descriptors processed per interrupt", sc->rxq.st_batch);
+
+	node = SYSCTL_ADD_NODE(ctx, SYSCTL_CHILDREN(tree), OID_AUTO,
+	    "ict", CTLFLAG_RD, NULL, "interrupt cause table");
+	SYSCTL_ADD_UINT(ctx, SYSCTL_CHILDREN(node), OID_AUTO,
+	    "overflows", CTLFLAG_RD, &sc->ict_overflows, 0,
+	    "times the device lapped the driver");
+	iwn_sysctl_hist(ctx, node, "entries",
+	    "entries drained per interrupt", sc->ict_hist);
+}
+
+static int
+iwn_sysctl_fw_cached(SYSCTL_HANDLER_ARGS)
+{
+	struct iwn_softc *sc = arg1;
+	int error, val;
+
+	val = (sc->fw_fp != NULL);
+	error = sysctl_handle_int(oidp, &val, 0, req);
+	if (error != 0 || req->newptr == NULL)
+		return error;
+	if (val != 0)
+		return 0;
+
+	IWN_LOCK(sc);
+	/* The image is being DMA'd to the device, don't pull it away. */
+	if (sc->sc_flags & IWN_FLAG_FW_LOADING)
+		error = EBUSY;
+	else
+		iwn_release_firmware(sc);
+	IWN_UNLOCK(sc);
+	return error;
+}
+
+/*
+ * Export or import the calibration results of the INIT firmware so that
+ * they survive a module reload.  An imported blob is only used if it
+ * matches the adapter type and the firmware version loaded at next init.
+ */
+static int
+iwn_sysctl_calib_cache(SYSCTL_HANDLER_ARGS)
+{
+	struct iwn_softc *sc = arg1;
+	struct iwn_calib_blob_hdr *hdr;
+	struct iwn_calib_blob_ent *ent;
+	uint8_t *buf, *p, *end;
+	size_t len;
+	int error, idx, n;
+
+	buf = malloc(IWN_CALIB_BLOB_MAXSZ, M_DEVBUF, M_WAITOK | M_ZERO);
+
+	/* Serialize the current results. */
+	IWN_LOCK(sc);
+	hdr = (struct iwn_calib_blob_hdr *)buf;
+	p = (uint8_t *)(hdr + 1);
+	if (sc->sc_flags & IWN_FLAG_CALIB_DONE) {
+		hdr->magic = IWN_CALIB_BLOB_MAGIC;
+		hdr->fwver = sc->calib_fwver;
+		hdr->tband = sc->calib_tband;
+		hdr->hw_type = sc->hw_type;
+		for (idx = 0; idx < IWN5000_PHY_CALIB_MAX_RESULT; idx++) {
+			if (sc->calibcmd[idx].buf == NULL)
+				continue;
+			if (p + sizeof (*ent) + sc->calibcmd[idx].len >
+			    buf + IWN_CALIB_BLOB_MAXSZ)
+				break;
+			ent = (struct iwn_calib_blob_ent *)p;
+			ent->idx = idx;
+			ent->len = sc->calibcmd[idx].len;
+			memcpy(ent + 1, sc->calibcmd[idx].buf, ent->len);
+			p += sizeof (*ent) + ent->len;
+			hdr->nentries++;
+		}
+	}
+	IWN_UNLOCK(sc);
+	len = (hdr->nentries != 0) ? (size_t)(p - buf) : 0;
+
+	error = SYSCTL_OUT(req, buf, len);
+	if (error != 0 || req->newptr == NULL)
+		goto out;
+
+	/* Import a new blob. */
+	len = req->newlen - req->newidx;
+	if (len < sizeof (*hdr) || len > IWN_CALIB_BLOB_MAXSZ) {
+		error = EINVAL;
+		goto out;
+	}
+	memset(buf, 0, IWN_CALIB_BLOB_MAXSZ);
+	if ((error = SYSCTL_IN(req, buf, len)) != 0)
+		goto out;
+	end = buf + len;
+	if (hdr->magic != IWN_CALIB_BLOB_MAGIC ||
+	    hdr->hw_type != sc->hw_type || hdr->nentries == 0) {
+		error = EINVAL;
+		goto out;
+	}
+	/* Validate all records before touching the current results. */
+	for (n = 0, p = (uint8_t *)(hdr + 1); n < hdr->nentries; n++) {
+		ent = (struct iwn_calib_blob_ent *)p;
+		if (p + sizeof (*ent) > end ||
+		    ent->idx >= IWN5000_PHY_CALIB_MAX_RESULT || ent->len == 0 ||
+		    ent->len > IWN_CMD_MAXSZ ||
+		    p + sizeof (*ent) + ent->len > end) {
+			error = EINVAL;
+			goto out;
+		}
+		p += sizeof (*ent) + ent->len;
+	}
+
+	IWN_LOCK(sc);
+	iwn_calib_flush(sc);
+	for (n = 0, p = (uint8_t *)(hdr + 1); n < hdr->nentries; n++) {
+		ent = (struct iwn_calib_blob_ent *)p;
+		idx = ent->idx;
+		if (sc->calibcmd[idx].buf != NULL)
+			free(sc->calibcmd[idx].buf, M_DEVBUF);
+		sc->calibcmd[idx].buf = malloc(ent->len, M_DEVBUF, M_NOWAIT);
+		if (sc->calibcmd[idx].buf == NULL) {
+			iwn_calib_flush(sc);
+			error = ENOMEM;
+			break;
+		}
+		memcpy(sc->calibcmd[idx].buf, ent + 1, ent->len);
+		sc->calibcmd[idx].len = ent->len;
+		p += sizeof (*ent) + ent->len;
+	}
+	if (error == 0) {
+		sc->calib_fwver = hdr->fwver;
+		sc->calib_tband = hdr->tband;
+		sc->calib_stamp = time_uptime;
+		sc->sc_flags |= IWN_FLAG_CALIB_DONE;
+	}
+	IWN_UNLOCK(sc);
+out:
+	free(buf, M_DEVBUF);
+	return error;
+}
+
+/*
+ * Export the ROM image shadowed at attach time.
+ */
+static int
+iwn_sysctl_eeprom(SYSCTL_HANDLER_ARGS)
+{
+	struct iwn_softc *sc = arg1;
+
+	return SYSCTL_OUT(req, sc->eeprom_shadow, sc->eeprom_shadow_len);
+}
+
+/*
+ * Start (1) or stop (0) the binary event trace.  Events are only logged
+ * with the driver or TX lock held, so the ring can be swapped under both.
+ */
+static int
+iwn_sysctl_trace(SYSCTL_HANDLER_ARGS)
+{
+	struct iwn_softc *sc = arg1;
+	struct iwn_trace_ent *ring, *old;
+	int error, val;
+
+	val = (sc->sc_trace != NULL);
+	error = sysctl_handle_int(oidp, &val, 0, req);
+	if (error != 0 || req->newptr == NULL)
+		return error;
+
+	ring = NULL;
+	if (val != 0)
+		ring = malloc(IWN_TRACE_COUNT * sizeof (*ring), M_DEVBUF,
+		    M_WAITOK | M_ZERO);
+	IWN_LOCK(sc);
+	IWN_TX_LOCK(sc);
+	old = sc->sc_trace;
+	sc->sc_trace_cur = 0;
+	sc->sc_trace = ring;
+	IWN_TX_UNLOCK(sc);
+	IWN_UNLOCK(sc);
+	if (old != NULL)
+		free(old, M_DEVBUF);
+	return 0;
 }
 
+static int
+iwn_sysctl_trace_buf(SYSCTL_HANDLER_ARGS)
+{
+	struct iwn_softc *sc = arg1;
+	struct iwn_trace_ent *buf;
+	u_int cur, n, first, i;
+	int error;
+
+	buf = malloc(IWN_TRACE_COUNT * sizeof (*buf), M_DEVBUF, M_WAITOK);
+	IWN_LOCK(sc);
+	n = 0;
+	if (sc->sc_trace != NULL) {
+		cur = sc->sc_trace_cur;
+		n = MIN(cur, IWN_TRACE_COUNT);
+		first = cur - n;
+		for (i = 0; i < n; i++)
+			buf[i] = sc->sc_trace[(first + i) &
+			    (IWN_TRACE_COUNT - 1)];
+	}
+	IWN_UNLOCK(sc);
+	error = SYSCTL_OUT(req, buf, n * sizeof (*buf));
+	free(buf, M_DEVBUF);
+	return error;
+}
+
+static int
+iwn_sysctl_crashdump(SYSCTL_HANDLER_ARGS)
+{
+	struct iwn_softc *sc = arg1;
+	struct iwn_crashdump *buf;
+	int error, valid;
+
+	buf = malloc(sizeof (*buf), M_DEVBUF, M_WAITOK);
+	IWN_LOCK(sc);
+	valid = (sc->crash->magic == IWN_CRASH_MAGIC);
+	if (valid)
+		memcpy(buf, sc->crash, sizeof (*buf));
+	IWN_UNLOCK(sc);
+	error = SYSCTL_OUT(req, buf, valid ? sizeof (*buf) : 0);
+	free(buf, M_DEVBUF);
+	return error;
+}
+
+static void
+iwn_trace_log(struct iwn_softc *sc, int id, uint32_t a0, uint32_t a1,
+    uint32_t a2)
+{
+	struct iwn_trace_ent *ent;
+
+	ent = &sc->sc_trace[atomic_fetchadd_int(&sc->sc_trace_cur, 1) &
+	    (IWN_TRACE_COUNT - 1)];
+	ent->tsc = get_cyclecount();
+	ent->id = id;
+	ent->cpu = curcpu;
+	ent->arg[0] = a0;
+	ent->arg[1] = a1;
+	ent->arg[2] = a2;
+}
+
+#ifdef	IWN_DEBUG
+/*
+ * Start (1) or stop (0) register access tracing.  The ring is allocated
+ * on start and restarted empty; stopping frees it.
+ */
+static int
+iwn_sysctl_regtrace(SYSCTL_HANDLER_ARGS)
+{
+	struct iwn_softc *sc = arg1;
+	struct iwn_regtrace_ent *ring, *old;
+	int error, val;
+
+	val = (sc->regtrace != NULL);
+	error = sysctl_handle_int(oidp, &val, 0, req);
+	if (error != 0 || req->newptr == NULL)
+		return error;
+
+	ring = NULL;
+	if (val != 0)
+		ring = malloc(IWN_REGTRACE_COUNT * sizeof (*ring), M_DEVBUF,
+		    M_WAITOK | M_ZERO);
+	IWN_LOCK(sc);
+	IWN_TX_LOCK(sc);
+	old = sc->regtrace;
+	sc->regtrace_cur = 0;
+	sc->regtrace = ring;
+	IWN_TX_UNLOCK(sc);
+	IWN_UNLOCK(sc);
+	if (old != NULL)
+		free(old, M_DEVBUF);
+	return 0;
+}
+
+static int
+iwn_sysctl_regtrace_buf(SYSCTL_HANDLER_ARGS)
+{
+	struct iwn_softc *sc = arg1;
+	struct iwn_regtrace_ent *buf;
+	u_int cur, n, first, i;
+	int error;
+
+	buf = malloc(IWN_REGTRACE_COUNT * sizeof (*buf), M_DEVBUF, M_WAITOK);
+	IWN_LOCK(sc);
+	n = 0;
+	if (sc->regtrace != NULL) {
+		cur = sc->regtrace_cur;
+		n = MIN(cur, IWN_REGTRACE_COUNT);
+		first = cur - n;
+		for (i = 0; i < n; i++)
+			buf[i] = sc->regtrace[(first + i) &
+			    (IWN_REGTRACE_COUNT - 1)];
+	}
+	IWN_UNLOCK(sc);
+	error = SYSCTL_OUT(req, buf, n * sizeof (*buf));
+	free(buf, M_DEVBUF);
+	return error;
+}
+#endif
+
 static struct ieee80211vap *
 iwn_vap_create(struct ieee80211com *ic, const char name[IFNAMSIZ], int unit,
     enum ieee80211_opmode opmode, int flags,
@@ -959,20 +1837,43 @@ iwn_detach(device_t dev)
 
 	DPRINTF(sc, IWN_DEBUG_TRACE | IWN_DEBUG_RESET, "->%s begin\n", __func__);
 
+	if (sc->sc_evtdev != NULL) {
+		/* Kick readers out before the device goes away. */
+		IWN_LOCK(sc);
+		sc->evtlog_gone = 1;
+		wakeup(&sc->evtlog_prod);
+		IWN_UNLOCK(sc);
+		destroy_dev(sc->sc_evtdev);
+		callout_drain(&sc->evtlog_to);
+		if (sc->evtlog != NULL) {
+			free(sc->evtlog, M_DEVBUF);
+			free(sc->evtlog_buf, M_DEVBUF);
+		}
+	}
+
 	if (ifp != NULL) {
 		ic = ifp->if_l2com;
 
 		ieee80211_draintask(ic, &sc->sc_reinit_task);
+		ieee80211_draintask(ic, &sc->sc_restart_task);
 		ieee80211_draintask(ic, &sc->sc_radioon_task);
 		ieee80211_draintask(ic, &sc->sc_radiooff_task);
 
 		iwn_stop(sc);
+		ieee80211_draintask(ic, &sc->sc_txqfree_task);
 		callout_drain(&sc->watchdog_to);
 		callout_drain(&sc->ct_kill_exit_to);
 		callout_drain(&sc->calib_to);
 		ieee80211_ifdetach(ic);
 	}
 
+	if (sc->fw_fp != NULL) {
+		IWN_LOCK(sc);
+		iwn_release_firmware(sc);
+		IWN_UNLOCK(sc);
+	}
+	iwn_calib_flush(sc);
+
 	/* Uninstall interrupt handler. */
 	if (sc->irq != NULL) {
 		bus_teardown_intr(dev, sc->irq, sc->sc_ih);
@@ -983,8 +1884,11 @@ iwn_detach(device_t dev)
 
 	/* Free DMA resources. */
 	iwn_free_rx_ring(sc, &sc->rxq);
-	for (qid = 0; qid < sc->ntxqs; qid++)
+	for (qid = 0; qid < sc->ntxqs; qid++) {
 		iwn_free_tx_ring(sc, &sc->txq[qid]);
+		if (mtx_initialized(&sc->txq[qid].mtx))
+			mtx_destroy(&sc->txq[qid].mtx);
+	}
 	iwn_free_sched(sc);
 	iwn_free_kw(sc);
 	if (sc->ict != NULL)
@@ -993,12 +1897,22 @@ iwn_detach(device_t dev)
 
 	if (sc->mem != NULL)
 		bus_release_resource(dev, SYS_RES_MEMORY, sc->mem_rid, sc->mem);
+	if (sc->sc_trace != NULL)
+		free(sc->sc_trace, M_DEVBUF);
+	if (sc->crash != NULL)
+		free(sc->crash, M_DEVBUF);
+#ifdef	IWN_DEBUG
+	if (sc->regtrace != NULL)
+		free(sc->regtrace, M_DEVBUF);
+#endif
 
 	if (ifp != NULL)
 		if_free(ifp);
 
 	DPRINTF(sc, IWN_DEBUG_TRACE | IWN_DEBUG_RESET, "->%s: end\n",__func__);
 
+	IWN_RX_LOCK_DESTROY(sc);
+	IWN_TX_LOCK_DESTROY(sc);
 	IWN_LOCK_DESTROY(sc);
 	return 0;
 }
@@ -1053,11 +1967,26 @@ iwn_resume(device_t dev)
 	return 0;
 }
 
+/*
+ * Request access to the NIC, waking it up if needed.  Calls nest: only the
+ * outermost one sets MAC_ACCESS_REQ and waits for the MAC to wake up, and
+ * the request is held until the matching outermost iwn_nic_unlock() or,
+ * inside an iwn_nic_batch_begin()/end() section, until the batch ends.
+ */
 static int
 iwn_nic_lock(struct iwn_softc *sc)
 {
 	int ntries;
 
+	/* nic_ref and friends are protected by the driver lock. */
+	IWN_LOCK_ASSERT(sc);
+
+	if (sc->nic_awake) {
+		sc->nic_ref++;
+		sc->nic_nested++;
+		return 0;
+	}
+
 	/* Request exclusive access to NIC. */
 	IWN_SETBITS(sc, IWN_GP_CNTRL, IWN_GP_CNTRL_MAC_ACCESS_REQ);
 
@@ -1065,10 +1994,18 @@ iwn_nic_lock(struct iwn_softc *sc)
 	for (ntries = 0; ntries < 1000; ntries++) {
 		if ((IWN_READ(sc, IWN_GP_CNTRL) &
 		     (IWN_GP_CNTRL_MAC_ACCESS_ENA | IWN_GP_CNTRL_SLEEP)) ==
-		    IWN_GP_CNTRL_MAC_ACCESS_ENA)
+		    IWN_GP_CNTRL_MAC_ACCESS_ENA) {
+			sc->nic_awake = 1;
+			sc->nic_ref = 1;
+			sc->nic_wakes++;
+			sc->nic_spins += ntries;
+			if (ntries * 10 > sc->nic_maxwait)
+				sc->nic_maxwait = ntries * 10;
 			return 0;
+		}
 		DELAY(10);
 	}
+	sc->nic_timeouts++;
 	DPRINTF(sc, IWN_DEBUG_TRACE | IWN_DEBUG_FATAL, "->%s timeout\n", __func__);
 
 	return ETIMEDOUT;
@@ -1077,90 +2014,298 @@ iwn_nic_lock(struct iwn_softc *sc)
 static __inline void
 iwn_nic_unlock(struct iwn_softc *sc)
 {
-	IWN_CLRBITS(sc, IWN_GP_CNTRL, IWN_GP_CNTRL_MAC_ACCESS_REQ);
+	if (sc->nic_ref > 0)
+		sc->nic_ref--;
+	if (sc->nic_ref == 0 && sc->nic_batch == 0) {
+		sc->nic_awake = 0;
+		IWN_CLRBITS(sc, IWN_GP_CNTRL, IWN_GP_CNTRL_MAC_ACCESS_REQ);
+	}
+}
+
+/*
+ * Keep the NIC awake between the iwn_nic_lock()/unlock() pairs issued
+ * until iwn_nic_batch_end().  Nothing is done if nobody asks for access.
+ */
+static __inline void
+iwn_nic_batch_begin(struct iwn_softc *sc)
+{
+	sc->nic_batch++;
+}
+
+static __inline void
+iwn_nic_batch_end(struct iwn_softc *sc)
+{
+	if (sc->nic_batch == 0)
+		return;		/* Reset by iwn_hw_stop() meanwhile. */
+	if (--sc->nic_batch == 0 && sc->nic_ref == 0 && sc->nic_awake) {
+		sc->nic_awake = 0;
+		IWN_CLRBITS(sc, IWN_GP_CNTRL, IWN_GP_CNTRL_MAC_ACCESS_REQ);
+	}
+}
+
+/*
+ * Tag the register accesses the current thread makes next with a code
+ * path, for the regstats sysctls.  The TX path and the interrupt handler
+ * run concurrently, so each thread gets its own slot, claimed by the
+ * outermost iwn_regpath_enter().  Returns the previous path for
+ * iwn_regpath_leave(), or -1 if no slot was free (accesses then count
+ * as "other").
+ */
+static __inline int
+iwn_regpath_enter(struct iwn_softc *sc, int path)
+{
+	struct iwn_regpath_slot *slot;
+	int i, opath;
+
+	for (i = 0; i < IWN_REGPATH_SLOTS; i++) {
+		slot = &sc->regpath[i];
+		if (slot->td == curthread) {
+			opath = slot->path;
+			slot->path = path;
+			return opath;
+		}
+	}
+	for (i = 0; i < IWN_REGPATH_SLOTS; i++) {
+		slot = &sc->regpath[i];
+		if (atomic_cmpset_ptr((volatile uintptr_t *)&slot->td,
+		    (uintptr_t)NULL, (uintptr_t)curthread)) {
+			slot->path = path;
+			return IWN_REGPATH_OTHER;
+		}
+	}
+	return -1;
+}
+
+static __inline void
+iwn_regpath_leave(struct iwn_softc *sc, int opath)
+{
+	struct iwn_regpath_slot *slot;
+	int i;
+
+	if (opath < 0)
+		return;
+	for (i = 0; i < IWN_REGPATH_SLOTS; i++) {
+		slot = &sc->regpath[i];
+		if (slot->td != curthread)
+			continue;
+		slot->path = opath;
+		if (opath == IWN_REGPATH_OTHER)	/* Outermost, release. */
+			atomic_store_rel_ptr((volatile uintptr_t *)&slot->td,
+			    (uintptr_t)NULL);
+		return;
+	}
 }
 
+static __inline int
+iwn_regpath_cur(struct iwn_softc *sc)
+{
+	int i;
+
+	for (i = 0; i < IWN_REGPATH_SLOTS; i++)
+		if (sc->regpath[i].td == curthread)
+			return sc->regpath[i].path;
+	return IWN_REGPATH_OTHER;
+}
+
+#ifdef	IWN_DEBUG
+static void
+iwn_regtrace_log(struct iwn_softc *sc, int op, uint32_t addr, uint32_t val,
+    int line)
+{
+	struct iwn_regtrace_ent *ent;
+
+	ent = &sc->regtrace[atomic_fetchadd_int(&sc->regtrace_cur, 1) &
+	    (IWN_REGTRACE_COUNT - 1)];
+	ent->tsc = get_cyclecount();
+	ent->addr = addr;
+	ent->val = val;
+	ent->line = line;
+	ent->op = op;
+	ent->path = iwn_regpath_cur(sc);
+}
+
+static uint32_t
+iwn_reg_read(struct iwn_softc *sc, bus_size_t reg, int line)
+{
+	struct iwn_regstat *rs = &sc->regstat[iwn_regpath_cur(sc)];
+	uint64_t t0;
+	uint32_t val;
+
+	t0 = get_cyclecount();
+	val = bus_space_read_4(sc->sc_st, sc->sc_sh, reg);
+	rs->read_cycles += get_cyclecount() - t0;
+	rs->reads++;
+	if (sc->regtrace != NULL)
+		iwn_regtrace_log(sc, IWN_REGTRACE_READ, reg, val, line);
+	return val;
+}
+
+static void
+iwn_reg_write(struct iwn_softc *sc, bus_size_t reg, uint32_t val, int line)
+{
+	bus_space_write_4(sc->sc_st, sc->sc_sh, reg, val);
+	sc->regstat[iwn_regpath_cur(sc)].writes++;
+	if (sc->regtrace != NULL)
+		iwn_regtrace_log(sc, IWN_REGTRACE_WRITE, reg, val, line);
+}
+
+static void
+iwn_reg_write_1(struct iwn_softc *sc, bus_size_t reg, uint8_t val, int line)
+{
+	bus_space_write_1(sc->sc_st, sc->sc_sh, reg, val);
+	sc->regstat[iwn_regpath_cur(sc)].writes++;
+	if (sc->regtrace != NULL)
+		iwn_regtrace_log(sc, IWN_REGTRACE_WRITE_1, reg, val, line);
+}
+
+#define IWN_REGTRACE_IND(sc, op, addr, val, cnt, line) do {		\
+	(sc)->regstat[iwn_regpath_cur(sc)].cnt++;			\
+	if ((sc)->regtrace != NULL)					\
+		iwn_regtrace_log((sc), (op), (addr), (val), (line));	\
+} while (0)
+#else
+#define IWN_REGTRACE_IND(sc, op, addr, val, cnt, line)
+#endif
+
+/*
+ * The PRPH and SRAM accessors take the caller's line for the register
+ * trace; use them through the wrapper macros below.
+ */
 static __inline uint32_t
-iwn_prph_read(struct iwn_softc *sc, uint32_t addr)
+_iwn_prph_read(struct iwn_softc *sc, uint32_t addr, int line)
 {
-	IWN_WRITE(sc, IWN_PRPH_RADDR, IWN_PRPH_DWORD | addr);
+	uint32_t val;
+
+	IWN_WRITE_LINE(sc, IWN_PRPH_RADDR, IWN_PRPH_DWORD | addr, line);
 	IWN_BARRIER_READ_WRITE(sc);
-	return IWN_READ(sc, IWN_PRPH_RDATA);
+	val = IWN_READ_LINE(sc, IWN_PRPH_RDATA, line);
+	IWN_REGTRACE_IND(sc, IWN_REGTRACE_PRPH_READ, addr, val, prph, line);
+	return val;
 }
 
 static __inline void
-iwn_prph_write(struct iwn_softc *sc, uint32_t addr, uint32_t data)
+_iwn_prph_write(struct iwn_softc *sc, uint32_t addr, uint32_t data, int line)
 {
-	IWN_WRITE(sc, IWN_PRPH_WADDR, IWN_PRPH_DWORD | addr);
+	IWN_WRITE_LINE(sc, IWN_PRPH_WADDR, IWN_PRPH_DWORD | addr, line);
 	IWN_BARRIER_WRITE(sc);
-	IWN_WRITE(sc, IWN_PRPH_WDATA, data);
+	IWN_WRITE_LINE(sc, IWN_PRPH_WDATA, data, line);
+	IWN_REGTRACE_IND(sc, IWN_REGTRACE_PRPH_WRITE, addr, data, prph, line);
 }
 
 static __inline void
-iwn_prph_setbits(struct iwn_softc *sc, uint32_t addr, uint32_t mask)
+_iwn_prph_setbits(struct iwn_softc *sc, uint32_t addr, uint32_t mask,
+    int line)
 {
-	iwn_prph_write(sc, addr, iwn_prph_read(sc, addr) | mask);
+	_iwn_prph_write(sc, addr, _iwn_prph_read(sc, addr, line) | mask, line);
 }
 
 static __inline void
-iwn_prph_clrbits(struct iwn_softc *sc, uint32_t addr, uint32_t mask)
+_iwn_prph_clrbits(struct iwn_softc *sc, uint32_t addr, uint32_t mask,
+    int line)
 {
-	iwn_prph_write(sc, addr, iwn_prph_read(sc, addr) & ~mask);
+	_iwn_prph_write(sc, addr, _iwn_prph_read(sc, addr, line) & ~mask, line);
 }
 
 static __inline void
-iwn_prph_write_region_4(struct iwn_softc *sc, uint32_t addr,
-    const uint32_t *data, int count)
+_iwn_prph_write_region_4(struct iwn_softc *sc, uint32_t addr,
+    const uint32_t *data, int count, int line)
 {
 	for (; count > 0; count--, data++, addr += 4)
-		iwn_prph_write(sc, addr, *data);
+		_iwn_prph_write(sc, addr, *data, line);
 }
 
 static __inline uint32_t
-iwn_mem_read(struct iwn_softc *sc, uint32_t addr)
+_iwn_mem_read(struct iwn_softc *sc, uint32_t addr, int line)
 {
-	IWN_WRITE(sc, IWN_MEM_RADDR, addr);
+	uint32_t val;
+
+	IWN_WRITE_LINE(sc, IWN_MEM_RADDR, addr, line);
 	IWN_BARRIER_READ_WRITE(sc);
-	return IWN_READ(sc, IWN_MEM_RDATA);
+	val = IWN_READ_LINE(sc, IWN_MEM_RDATA, line);
+	IWN_REGTRACE_IND(sc, IWN_REGTRACE_MEM_READ, addr, val, mem, line);
+	return val;
 }
 
 static __inline void
-iwn_mem_write(struct iwn_softc *sc, uint32_t addr, uint32_t data)
+_iwn_mem_write(struct iwn_softc *sc, uint32_t addr, uint32_t data, int line)
 {
-	IWN_WRITE(sc, IWN_MEM_WADDR, addr);
+	IWN_WRITE_LINE(sc, IWN_MEM_WADDR, addr, line);
 	IWN_BARRIER_WRITE(sc);
-	IWN_WRITE(sc, IWN_MEM_WDATA, data);
+	IWN_WRITE_LINE(sc, IWN_MEM_WDATA, data, line);
+	IWN_REGTRACE_IND(sc, IWN_REGTRACE_MEM_WRITE, addr, data, mem, line);
 }
 
 static __inline void
-iwn_mem_write_2(struct iwn_softc *sc, uint32_t addr, uint16_t data)
+_iwn_mem_write_2(struct iwn_softc *sc, uint32_t addr, uint16_t data, int line)
 {
 	uint32_t tmp;
 
-	tmp = iwn_mem_read(sc, addr & ~3);
+	tmp = _iwn_mem_read(sc, addr & ~3, line);
 	if (addr & 3)
 		tmp = (tmp & 0x0000ffff) | data << 16;
 	else
 		tmp = (tmp & 0xffff0000) | data;
-	iwn_mem_write(sc, addr & ~3, tmp);
+	_iwn_mem_write(sc, addr & ~3, tmp, line);
 }
 
+/*
+ * The SRAM data ports auto-increment the target address after each access,
+ * so bulk transfers only need to set the address once.  The PRPH ports
+ * do not, hence iwn_prph_write_region_4() still goes word by word.
+ */
 static __inline void
-iwn_mem_read_region_4(struct iwn_softc *sc, uint32_t addr, uint32_t *data,
-    int count)
+_iwn_mem_read_region_4(struct iwn_softc *sc, uint32_t addr, uint32_t *data,
+    int count, int line)
 {
-	for (; count > 0; count--, addr += 4)
-		*data++ = iwn_mem_read(sc, addr);
+	IWN_WRITE_LINE(sc, IWN_MEM_RADDR, addr, line);
+	IWN_BARRIER_READ_WRITE(sc);
+	for (; count > 0; count--)
+		*data++ = IWN_READ_LINE(sc, IWN_MEM_RDATA, line);
 }
 
 static __inline void
-iwn_mem_set_region_4(struct iwn_softc *sc, uint32_t addr, uint32_t val,
-    int count)
+_iwn_mem_write_region_4(struct iwn_softc *sc, uint32_t addr,
+    const uint32_t *data, int count, int line)
 {
-	for (; count > 0; count--, addr += 4)
-		iwn_mem_write(sc, addr, val);
+	IWN_WRITE_LINE(sc, IWN_MEM_WADDR, addr, line);
+	IWN_BARRIER_WRITE(sc);
+	for (; count > 0; count--)
+		IWN_WRITE_LINE(sc, IWN_MEM_WDATA, *data++, line);
 }
 
+static __inline void
+_iwn_mem_set_region_4(struct iwn_softc *sc, uint32_t addr, uint32_t val,
+    int count, int line)
+{
+	IWN_WRITE_LINE(sc, IWN_MEM_WADDR, addr, line);
+	IWN_BARRIER_WRITE(sc);
+	for (; count > 0; count--)
+		IWN_WRITE_LINE(sc, IWN_MEM_WDATA, val, line);
+}
+
+#define iwn_prph_read(sc, addr)						\
+	_iwn_prph_read((sc), (addr), __LINE__)
+#define iwn_prph_write(sc, addr, data)					\
+	_iwn_prph_write((sc), (addr), (data), __LINE__)
+#define iwn_prph_setbits(sc, addr, mask)				\
+	_iwn_prph_setbits((sc), (addr), (mask), __LINE__)
+#define iwn_prph_clrbits(sc, addr, mask)				\
+	_iwn_prph_clrbits((sc), (addr), (mask), __LINE__)
+#define iwn_prph_write_region_4(sc, addr, data, count)			\
+	_iwn_prph_write_region_4((sc), (addr), (data), (count), __LINE__)
+#define iwn_mem_read(sc, addr)						\
+	_iwn_mem_read((sc), (addr), __LINE__)
+#define iwn_mem_write(sc, addr, data)					\
+	_iwn_mem_write((sc), (addr), (data), __LINE__)
+#define iwn_mem_write_2(sc, addr, data)					\
+	_iwn_mem_write_2((sc), (addr), (data), __LINE__)
+#define iwn_mem_read_region_4(sc, addr, data, count)			\
+	_iwn_mem_read_region_4((sc), (addr), (data), (count), __LINE__)
+#define iwn_mem_write_region_4(sc, addr, data, count)			\
+	_iwn_mem_write_region_4((sc), (addr), (data), (count), __LINE__)
+#define iwn_mem_set_region_4(sc, addr, val, count)			\
+	_iwn_mem_set_region_4((sc), (addr), (val), (count), __LINE__)
+
 static __inline int
 iwn_get_antenna(uint32_t rate_n_flag)
 {
@@ -1253,46 +2398,70 @@ iwn_init_otprom(struct iwn_softc *sc)
 	return 0;
 }
 
+/*
+ * Read one 16-bit word from the ROM, without the OTPROM block offset.
+ */
 static int
-iwn_read_prom_data(struct iwn_softc *sc, uint32_t addr, void *data, int count)
+iwn_read_prom_word(struct iwn_softc *sc, uint32_t addr, uint16_t *word)
 {
-	uint8_t *out = data;
 	uint32_t val, tmp;
 	int ntries;
 
+	IWN_WRITE(sc, IWN_EEPROM, addr << 2);
+	for (ntries = 0; ntries < 10; ntries++) {
+		val = IWN_READ(sc, IWN_EEPROM);
+		if (val & IWN_EEPROM_READ_VALID)
+			break;
+		DELAY(5);
+	}
+	if (ntries == 10)
+		return ETIMEDOUT;
+	if (sc->sc_flags & IWN_FLAG_HAS_OTPROM) {
+		/* OTPROM, check for ECC errors. */
+		tmp = IWN_READ(sc, IWN_OTP_GP);
+		if (tmp & IWN_OTP_GP_ECC_UNCORR_STTS)
+			return EIO;
+		if (tmp & IWN_OTP_GP_ECC_CORR_STTS) {
+			/* Correctable ECC error, clear bit. */
+			IWN_SETBITS(sc, IWN_OTP_GP, IWN_OTP_GP_ECC_CORR_STTS);
+		}
+	}
+	*word = val >> 16;
+	return 0;
+}
+
+/*
+ * Read ROM data.  Once iwn_read_prom_shadow() has run, requests that fit
+ * in the shadow copy are served from RAM; others go to the hardware and
+ * thus need the ROM lock held.
+ */
+static int
+iwn_read_prom_data(struct iwn_softc *sc, uint32_t addr, void *data, int count)
+{
+	uint8_t *out = data;
+	uint16_t word;
+	int error;
+
 	DPRINTF(sc, IWN_DEBUG_TRACE | IWN_DEBUG_RESET, "->%s begin\n", __func__);
 
+	if (addr * 2 + count <= sc->eeprom_shadow_len) {
+		memcpy(out, &sc->eeprom_shadow[addr * 2], count);
+		sc->eeprom_shadow_hits++;
+		return 0;
+	}
+
 	addr += sc->prom_base;
 	for (; count > 0; count -= 2, addr++) {
-		IWN_WRITE(sc, IWN_EEPROM, addr << 2);
-		for (ntries = 0; ntries < 10; ntries++) {
-			val = IWN_READ(sc, IWN_EEPROM);
-			if (val & IWN_EEPROM_READ_VALID)
-				break;
-			DELAY(5);
-		}
-		if (ntries == 10) {
-			device_printf(sc->sc_dev,
-			    "timeout reading ROM at 0x%x\n", addr);
-			return ETIMEDOUT;
-		}
-		if (sc->sc_flags & IWN_FLAG_HAS_OTPROM) {
-			/* OTPROM, check for ECC errors. */
-			tmp = IWN_READ(sc, IWN_OTP_GP);
-			if (tmp & IWN_OTP_GP_ECC_UNCORR_STTS) {
-				device_printf(sc->sc_dev,
-				    "OTPROM ECC error at 0x%x\n", addr);
-				return EIO;
-			}
-			if (tmp & IWN_OTP_GP_ECC_CORR_STTS) {
-				/* Correctable ECC error, clear bit. */
-				IWN_SETBITS(sc, IWN_OTP_GP,
-				    IWN_OTP_GP_ECC_CORR_STTS);
-			}
+		if ((error = iwn_read_prom_word(sc, addr, &word)) != 0) {
+			device_printf(sc->sc_dev, "%s at 0x%x\n",
+			    (error == EIO) ? "OTPROM ECC error" :
+			    "timeout reading ROM", addr);
+			return error;
 		}
-		*out++ = val >> 16;
+		/* Words are stored little-endian, as in the ROM. */
+		*out++ = word & 0xff;
 		if (count > 1)
-			*out++ = val >> 24;
+			*out++ = word >> 8;
 	}
 
 	DPRINTF(sc, IWN_DEBUG_TRACE | IWN_DEBUG_RESET, "->%s end\n", __func__);
@@ -1300,6 +2469,34 @@ iwn_read_prom_data(struct iwn_softc *sc, uint32_t addr, void *data, int count)
 	return 0;
 }
 
+/*
+ * Copy the whole ROM image (relative to the OTPROM block base) into RAM
+ * so that the parsers below do not poll the ROM for every field.  Stop
+ * quietly at the first unreadable word: the shadow then only covers the
+ * readable prefix and iwn_read_prom_data() falls back to the hardware.
+ */
+static void
+iwn_read_prom_shadow(struct iwn_softc *sc)
+{
+	uint16_t word;
+	int len, max;
+
+	max = (sc->hw_type == IWN_HW_REV_TYPE_4965) ?
+	    IWN4965_EEPROM_SIZE : IWN_EEPROM_SHADOW_SZ;
+
+	sc->eeprom_shadow_len = 0;
+	for (len = 0; len < max; len += 2) {
+		if (iwn_read_prom_word(sc, sc->prom_base + len / 2, &word) != 0)
+			break;
+		sc->eeprom_shadow[len] = word & 0xff;
+		sc->eeprom_shadow[len + 1] = word >> 8;
+	}
+	sc->eeprom_shadow_len = len;
+
+	DPRINTF(sc, IWN_DEBUG_RESET, "%s: %d bytes of ROM shadowed\n",
+	    __func__, len);
+}
+
 static void
 iwn_dma_map_addr(void *arg, bus_dma_segment_t *segs, int nsegs, int error)
 {
@@ -1564,16 +2761,85 @@ iwn_free_rx_ring(struct iwn_softc *sc, struct iwn_rx_ring *ring)
 	}
 }
 
+static __inline int
+iwn_ring_hist(u_int n)
+{
+	return MIN(fls(n), IWN_RING_HIST - 1);
+}
+
+/*
+ * Account for a frame added to a TX ring, stopping the interface queue
+ * when the ring gets too full.  Data rings have a single producer (under
+ * the TX lock) and a single consumer (the interrupt handler), so only
+ * the occupancy count and qfullmsk are shared and updated atomically.
+ * Must be called before the frame is handed to the firmware, so that
+ * its completion can't be accounted for first.
+ */
+/*
+ * Clear the ring's qfullmsk bit.  Both the producer and the consumer may
+ * try, only the one that actually clears it accounts the time.
+ */
+static __inline void
+iwn_txq_clrfull(struct iwn_softc *sc, struct iwn_tx_ring *ring)
+{
+	uint32_t bit = 1 << ring->qid, mask;
+
+	do {
+		mask = sc->qfullmsk;
+		if (!(mask & bit))
+			return;
+	} while (!atomic_cmpset_32(&sc->qfullmsk, mask, mask & ~bit));
+	ring->st_full_ticks += ticks - ring->st_full_since;
+}
+
+static __inline void
+iwn_txq_enqueued(struct iwn_softc *sc, struct iwn_tx_ring *ring)
+{
+	int queued;
+
+	queued = atomic_fetchadd_int((volatile u_int *)&ring->queued, 1);
+	ring->st_occ[iwn_ring_hist(queued)]++;
+	ring->st_queued++;
+	if (++queued > ring->st_hiwat)
+		ring->st_hiwat = queued;
+	if (queued > IWN_TX_RING_HIMARK &&
+	    !(sc->qfullmsk & (1 << ring->qid))) {
+		ring->st_full++;
+		ring->st_full_since = ticks;
+		atomic_set_32(&sc->qfullmsk, 1 << ring->qid);
+		/*
+		 * The consumer may have drained the ring below the low mark
+		 * before seeing the bit; nobody else would clear it then.
+		 */
+		mb();
+		if (ring->queued < IWN_TX_RING_LOMARK)
+			iwn_txq_clrfull(sc, ring);
+	}
+}
+
+/*
+ * Account for n frames reclaimed from a TX ring; returns the number of
+ * frames still queued.
+ */
+static __inline int
+iwn_txq_reclaimed(struct iwn_tx_ring *ring, int n)
+{
+	ring->st_done += n;
+	ring->st_reclaim[iwn_ring_hist(n)]++;
+	return atomic_fetchadd_int((volatile u_int *)&ring->queued, -n) - n;
+}
+
 static int
 iwn_alloc_tx_ring(struct iwn_softc *sc, struct iwn_tx_ring *ring, int qid)
 {
-	bus_addr_t paddr;
 	bus_size_t size;
 	int i, error;
 
 	ring->qid = qid;
 	ring->queued = 0;
 	ring->cur = 0;
+	ring->read = 0;
+	ring->idle = 0;
 
 	DPRINTF(sc, IWN_DEBUG_TRACE | IWN_DEBUG_RESET, "->%s begin\n", __func__);
 
@@ -1609,14 +2875,9 @@ iwn_alloc_tx_ring(struct iwn_softc *sc, struct iwn_tx_ring *ring, int qid)
 		goto fail;
 	}
 
-	paddr = ring->cmd_dma.paddr;
 	for (i = 0; i < IWN_TX_RING_COUNT; i++) {
 		struct iwn_tx_data *data = &ring->data[i];
 
-		data->cmd_paddr = paddr;
-		data->scratch_paddr = paddr + 12;
-		paddr += sizeof (struct iwn_tx_cmd);
-
 		error = bus_dmamap_create(ring->data_dmat, 0, &data->map);
 		if (error != 0) {
 			device_printf(sc->sc_dev,
@@ -1635,13 +2896,25 @@ fail:	iwn_free_tx_ring(sc, ring);
 	return error;
 }
 
+/*
+ * Node references are dropped only after the ring lock is released, as
+ * the last one may tear the node down.  They are gathered a few at a
+ * time; by now the hardware is stopped and producers see !RUNNING, so
+ * briefly dropping the lock in the middle of the sweep is harmless.
+ */
 static void
 iwn_reset_tx_ring(struct iwn_softc *sc, struct iwn_tx_ring *ring)
 {
-	int i;
+	struct ieee80211_node *nis[16];
+	int i, n;
 
 	DPRINTF(sc, IWN_DEBUG_TRACE | IWN_DEBUG_RESET, "->doing %s \n", __func__);
 
+	if (ring->desc == NULL)
+		return;		/* Aggregation ring not allocated yet. */
+
+	n = 0;
+	IWN_TXQ_LOCK(ring);
 	for (i = 0; i < IWN_TX_RING_COUNT; i++) {
 		struct iwn_tx_data *data = &ring->data[i];
 
@@ -1652,14 +2925,27 @@ iwn_reset_tx_ring(struct iwn_softc *sc, struct iwn_tx_ring *ring)
 			m_freem(data->m);
 			data->m = NULL;
 		}
+		if (data->ni != NULL) {
+			if (n == nitems(nis)) {
+				IWN_TXQ_UNLOCK(ring);
+				while (n > 0)
+					ieee80211_free_node(nis[--n]);
+				IWN_TXQ_LOCK(ring);
+			}
+			nis[n++] = data->ni;
+			data->ni = NULL;
+		}
 	}
 	/* Clear TX descriptors. */
 	memset(ring->desc, 0, ring->desc_dma.size);
 	bus_dmamap_sync(ring->desc_dma.tag, ring->desc_dma.map,
 	    BUS_DMASYNC_PREWRITE);
-	sc->qfullmsk &= ~(1 << ring->qid);
+	iwn_txq_clrfull(sc, ring);
 	ring->queued = 0;
 	ring->cur = 0;
+	IWN_TXQ_UNLOCK(ring);
+	while (n > 0)
+		ieee80211_free_node(nis[--n]);
 }
 
 static void
@@ -1672,22 +2958,107 @@ iwn_free_tx_ring(struct iwn_softc *sc, struct iwn_tx_ring *ring)
 	iwn_dma_contig_free(&ring->desc_dma);
 	iwn_dma_contig_free(&ring->cmd_dma);
 
-	for (i = 0; i < IWN_TX_RING_COUNT; i++) {
-		struct iwn_tx_data *data = &ring->data[i];
+	for (i = 0; i < IWN_TX_RING_COUNT; i++) {
+		struct iwn_tx_data *data = &ring->data[i];
+
+		if (data->m != NULL) {
+			bus_dmamap_sync(ring->data_dmat, data->map,
+			    BUS_DMASYNC_POSTWRITE);
+			bus_dmamap_unload(ring->data_dmat, data->map);
+			m_freem(data->m);
+		}
+		data->m = NULL;
+		data->ni = NULL;
+		if (data->map != NULL)
+			bus_dmamap_destroy(ring->data_dmat, data->map);
+		data->map = NULL;
+	}
+	if (ring->data_dmat != NULL) {
+		bus_dma_tag_destroy(ring->data_dmat);
+		ring->data_dmat = NULL;
+	}
+	ring->desc = NULL;
+	ring->cmd = NULL;
+}
+
+/*
+ * Called every minute from the watchdog: count idle minutes for
+ * allocated aggregation rings and schedule their release.  With flush
+ * set (leaving RUN), unused rings are released right away.
+ */
+static void
+iwn_txq_check_idle(struct iwn_softc *sc, int flush)
+{
+	struct ieee80211com *ic = sc->sc_ifp->if_l2com;
+	struct iwn_tx_ring *ring;
+	int qid, expired = 0;
+
+	IWN_LOCK_ASSERT(sc);
+
+	for (qid = sc->firstaggqueue; qid < sc->ntxqs; qid++) {
+		ring = &sc->txq[qid];
+		if (ring->desc == NULL)
+			continue;
+		if (sc->qid2tap[qid] != NULL || ring->queued != 0)
+			ring->idle = 0;
+		else if (flush || ++ring->idle >= IWN_TXQ_IDLE_FREE) {
+			ring->idle = IWN_TXQ_IDLE_FREE;
+			expired = 1;
+		}
+	}
+	if (expired)
+		ieee80211_runtask(ic, &sc->sc_txqfree_task);
+}
+
+/*
+ * Release idle aggregation rings.  Runs from the taskqueue because DMA
+ * memory can't be freed with a mutex held; rings being freed are marked
+ * in txq_freeing so that iwn_addba_request() won't pick them meanwhile.
+ */
+static void
+iwn_txq_free_idle(void *arg0, int pending)
+{
+	struct iwn_softc *sc = arg0;
+	struct iwn_tx_ring *ring;
+	uint32_t mask = 0;
+	int qid;
 
-		if (data->m != NULL) {
-			bus_dmamap_sync(ring->data_dmat, data->map,
-			    BUS_DMASYNC_POSTWRITE);
-			bus_dmamap_unload(ring->data_dmat, data->map);
-			m_freem(data->m);
-		}
-		if (data->map != NULL)
-			bus_dmamap_destroy(ring->data_dmat, data->map);
+	IWN_LOCK(sc);
+	IWN_TX_LOCK(sc);
+	for (qid = sc->firstaggqueue; qid < sc->ntxqs; qid++) {
+		ring = &sc->txq[qid];
+		if (ring->desc == NULL || sc->qid2tap[qid] != NULL ||
+		    ring->queued != 0 || ring->idle < IWN_TXQ_IDLE_FREE)
+			continue;
+		ring->desc = NULL;	/* Hide it from iwn_reset_tx_ring(). */
+		mask |= 1 << qid;
+	}
+	sc->txq_freeing |= mask;
+	if (mask != 0 && iwn_nic_lock(sc) == 0) {
+		for (qid = sc->firstaggqueue; qid < sc->ntxqs; qid++)
+			if (mask & (1 << qid))
+				IWN_WRITE(sc, IWN_FH_CBBC_QUEUE(qid), 0);
+		iwn_nic_unlock(sc);
 	}
-	if (ring->data_dmat != NULL) {
-		bus_dma_tag_destroy(ring->data_dmat);
-		ring->data_dmat = NULL;
+	IWN_TX_UNLOCK(sc);
+	IWN_UNLOCK(sc);
+
+	if (mask == 0)
+		return;
+	for (qid = sc->firstaggqueue; qid < sc->ntxqs; qid++) {
+		if (!(mask & (1 << qid)))
+			continue;
+		DPRINTF(sc, IWN_DEBUG_XMIT, "%s: freeing idle TX ring %d\n",
+		    __func__, qid);
+		iwn_free_tx_ring(sc, &sc->txq[qid]);
 	}
+
+	IWN_LOCK(sc);
+	IWN_TX_LOCK(sc);
+	sc->txq_freeing &= ~mask;
+	sc->txq_frees += bitcount32(mask);
+	IWN_TX_UNLOCK(sc);
+	IWN_UNLOCK(sc);
 }
 
 static void
@@ -1700,13 +3071,8 @@ iwn5000_ict_reset(struct iwn_softc *sc)
 	IWN_WRITE(sc, IWN_INT_MASK, 0);
 
 	/* Reset ICT table. */
-	memset(sc->ict, 0, IWN_ICT_SIZE);
-	sc->ict_cur = 0;
-
-	/* Set physical address of ICT table (4KB aligned). */
 	DPRINTF(sc, IWN_DEBUG_RESET, "%s: enabling ICT\n", __func__);
-	IWN_WRITE(sc, IWN_DRAM_INT_TBL, IWN_DRAM_INT_TBL_ENABLE |
-	    IWN_DRAM_INT_TBL_WRAP_CHECK | sc->ict_dma.paddr >> 12);
+	iwn_ict_rewind(sc);
 
 	/* Enable periodic RX interrupt. */
 	sc->int_mask |= IWN_INT_RX_PERIODIC;
@@ -1764,6 +3130,9 @@ iwn_read_eeprom(struct iwn_softc *sc, uint8_t macaddr[IEEE80211_ADDR_LEN])
 		}
 	}
 
+	/* Read the whole image once; the parsers work from RAM. */
+	iwn_read_prom_shadow(sc);
+
 	iwn_read_prom_data(sc, IWN_EEPROM_SKU_CAP, &val, 2);
 	DPRINTF(sc, IWN_DEBUG_RESET, "SKU capabilities=0x%04x\n", le16toh(val));
 	/* Check if HT support is bonded out. */
@@ -2144,10 +3513,36 @@ iwn_read_eeprom_enhinfo(struct iwn_softc *sc)
 
 }
 
+/*
+ * net80211 expects a zeroed node; this also leaves every TID with an
+ * empty aggregation window (no frames, no bitmap).
+ */
+static int
+iwn_node_ctor(void *mem, int size, void *arg, int flags)
+{
+	memset(mem, 0, size);
+	return 0;
+}
+
 static struct ieee80211_node *
 iwn_node_alloc(struct ieee80211vap *vap, const uint8_t mac[IEEE80211_ADDR_LEN])
 {
-	return malloc(sizeof (struct iwn_node), M_80211_NODE,M_NOWAIT | M_ZERO);
+	return uma_zalloc(iwn_node_zone, M_NOWAIT);
+}
+
+/*
+ * Same as net80211's node_free(), except for the final release.
+ */
+static void
+iwn_node_free(struct ieee80211_node *ni)
+{
+	struct ieee80211com *ic = ni->ni_ic;
+
+	ieee80211_ratectl_node_deinit(ni);
+	ic->ic_node_cleanup(ni);
+	ieee80211_ies_cleanup(&ni->ni_ies);
+	ieee80211_psq_cleanup(&ni->ni_psq);
+	uma_zfree(iwn_node_zone, ni);
 }
 
 static __inline int
@@ -2302,6 +3697,10 @@ iwn_newstate(struct ieee80211vap *vap, enum ieee80211_state nstate, int arg)
 	IWN_LOCK(sc);
 	callout_stop(&sc->calib_to);
 
+	/* Aggregation rings left without a BA session can go now. */
+	if (vap->iv_state == IEEE80211_S_RUN && nstate != IEEE80211_S_RUN)
+		iwn_txq_check_idle(sc, 1);
+
 	sc->rxon = &sc->rx_on[IWN_RXON_BSS_CTX];
 
 	switch (nstate) {
@@ -2370,12 +3769,15 @@ static void
 iwn_calib_timeout(void *arg)
 {
 	struct iwn_softc *sc = arg;
+	int opath;
 
 	IWN_LOCK_ASSERT(sc);
 
 	/* Force automatic TX power calibration every 60 secs. */
 	if (++sc->calib_cnt >= 120) {
-		iwn_set_statistics_request(sc,true,false,1);
+		opath = iwn_regpath_enter(sc, IWN_REGPATH_CALIB);
+		iwn_set_statistics_request(sc, true, false, 1);
+		iwn_regpath_leave(sc, opath);
 		sc->calib_cnt = 0;
 	}
 	callout_reset(&sc->calib_to, msecs_to_ticks(500), iwn_calib_timeout,
@@ -2455,21 +3857,20 @@ iwn_rx_done(struct iwn_softc *sc, struct iwn_rx_desc *desc,
 
 	/* Discard frames with a bad FCS early. */
 	if ((flags & IWN_RX_NOERROR) != IWN_RX_NOERROR) {
-		DPRINTF(sc, IWN_DEBUG_RECV, "%s: RX flags error %x\n",
-		    __func__, flags);
+		IWN_TRACE(sc, IWN_EV_RX_BADFCS, flags, 0, 0);
 		ifp->if_ierrors++;
 		return;
 	}
 	/* Discard frames that are too short. */
 	if (len < sizeof (*wh)) {
-		DPRINTF(sc, IWN_DEBUG_RECV, "%s: frame too short: %d\n",
-		    __func__, len);
+		IWN_TRACE(sc, IWN_EV_RX_SHORT, len, 0, 0);
 		ifp->if_ierrors++;
 		return;
 	}
 
 	m1 = m_getjcl(M_DONTWAIT, MT_DATA, M_PKTHDR, IWN_RBUF_SIZE);
 	if (m1 == NULL) {
+		ring->st_nombuf++;
 		DPRINTF(sc, IWN_DEBUG_ANY, "%s: no mbuf to restock ring\n",
 		    __func__);
 		ifp->if_ierrors++;
@@ -2551,8 +3952,10 @@ iwn_rx_done(struct iwn_softc *sc, struct iwn_rx_desc *desc,
 			    "Rate found: 0x%08x and not translated\n", stat->rate);
 		}
 	}
-	DPRINTF(sc, IWN_DEBUG_RECV, "Tstmp : %lu\n",stat->tstamp);
+	IWN_TRACE(sc, IWN_EV_RX, len, le32toh(stat->rate), rssi);
+	SDT_PROBE3(iwn, , rx, done, len, rssi, le32toh(stat->rate));
 
+	IWN_RX_UNLOCK(sc);
 	IWN_UNLOCK(sc);
 
 	/* Send the frame to the 802.11 layer. */
@@ -2566,6 +3969,7 @@ iwn_rx_done(struct iwn_softc *sc, struct iwn_rx_desc *desc,
 		(void)ieee80211_input_all(ic, m, rssi - nf, nf);
 
 	IWN_LOCK(sc);
+	IWN_RX_LOCK(sc);
 
 	DPRINTF(sc, IWN_DEBUG_TRACE | IWN_DEBUG_RECV, "->%s: end\n",__func__);
 
@@ -2588,7 +3992,8 @@ iwn_rx_compressed_ba(struct iwn_softc *sc, struct iwn_rx_desc *desc,
 	uint64_t bitmap;
 	uint16_t ssn;
 	uint8_t tid;
-	int ackfailcnt = 0, i, lastidx, qid, *res, shift;
+	int ackfailcnt = 0, i, lastidx, qid, *res, shift, nreclaimed = 0;
+	int queued;
 
 	DPRINTF(sc, IWN_DEBUG_TRACE | IWN_DEBUG_RECV, "->%s begin\n", __func__);
 
@@ -2626,16 +4031,22 @@ iwn_rx_compressed_ba(struct iwn_softc *sc, struct iwn_rx_desc *desc,
 		m_freem(m);
 		ieee80211_free_node(ni);
 
-		txq->queued--;
 		txq->read = (txq->read + 1) % IWN_TX_RING_COUNT;
+		nreclaimed++;
 	}
+	queued = iwn_txq_reclaimed(txq, nreclaimed);
+	SDT_PROBE3(iwn, , rx, compressed__ba, qid, le16toh(ba->ssn),
+	    nreclaimed);
 
-	if (txq->queued == 0 && res != NULL) {
+	if (queued == 0 && res != NULL) {
 		iwn_nic_lock(sc);
 		ops->ampdu_tx_stop(sc, qid, tid, ssn);
 		iwn_nic_unlock(sc);
+		/* Transmitters look up the ring through txa_private. */
+		IWN_TX_LOCK(sc);
 		sc->qid2tap[qid] = NULL;
-		free(res, M_DEVBUF);
+		tap->txa_private = NULL;
+		IWN_TX_UNLOCK(sc);
 		return;
 	}
 
@@ -2733,6 +4144,43 @@ iwn5000_rx_calib_results(struct iwn_softc *sc, struct iwn_rx_desc *desc,
 	DPRINTF(sc, IWN_DEBUG_TRACE | IWN_DEBUG_CALIBRATE, "->%s end\n", __func__);
 }
 
+/*
+ * Fold a statistics report into the 64-bit totals.  Firmware counters are
+ * 32-bit and cumulative since the last clear, so accumulate the modulo-2^32
+ * difference with the previous report.  The baseline is reset when the
+ * firmware restarts or has been asked to clear its counters.
+ */
+static void
+iwn_fwstats_update(struct iwn_softc *sc, const struct iwn_stats *stats,
+    int type)
+{
+	const uint32_t *raw = (const uint32_t *)stats;
+	struct iwn_calib_state *calib = &sc->calib;
+	uint32_t val;
+	u_int i, w;
+
+	for (i = 0; i < nitems(iwn_fwstats); i++) {
+		w = iwn_fwstats[i].off / 4;
+		val = le32toh(raw[w]);
+		if (iwn_fwstats[i].counter)
+			sc->fwstats[w] += val - sc->fwstats_last[w];
+		else
+			sc->fwstats[w] = val;
+		sc->fwstats_last[w] = val;
+	}
+
+	if (type == IWN_BEACON_STATISTICS)
+		return;
+	if (++sc->fwstats_replies == sc->fwstats_clear_seq &&
+	    sc->fwstats_clear_pending) {
+		/* This reply was sent just before the counters were reset. */
+		memset(sc->fwstats_last, 0, sizeof sc->fwstats_last);
+		calib->bad_plcp_ofdm = calib->fa_ofdm = 0;
+		calib->bad_plcp_cck = calib->fa_cck = 0;
+		sc->fwstats_clear_pending = 0;
+	}
+}
+
 /*
  * Process an RX_STATISTICS or BEACON_STATISTICS firmware notification.
  * The latter is sent by the firmware after each received beacon.
@@ -2757,6 +4205,25 @@ iwn_rx_statistics(struct iwn_softc *sc, struct iwn_rx_desc *desc,
 
 	DPRINTF(sc, IWN_DEBUG_TRACE | IWN_DEBUG_CALIBRATE, "->%s begin\n", __func__);
 
+	/* Counters are accumulated even when not used for calibration. */
+	bus_dmamap_sync(sc->rxq.data_dmat, data->map, BUS_DMASYNC_POSTREAD);
+	iwn_fwstats_update(sc, stats, desc->type);
+
+	/* Test if temperature has changed. */
+	if (stats->general.temp != sc->rawtemp) {
+		/* Convert "raw" temperature to degC. */
+		sc->rawtemp = stats->general.temp;
+		temp = ops->get_temperature(sc);
+		sc->curtemp = temp;
+		DPRINTF(sc, IWN_DEBUG_CALIBRATE, "%s: temperature %d\n",
+		    __func__, temp);
+		if ((sc->sc_flags & IWN_FLAG_CALIB_DONE) &&
+		    sc->calib_tband == IWN_CALIB_TBAND_UNKNOWN)
+			sc->calib_tband = temp / IWN_CALIB_TBAND_WIDTH;
+	}
+	/* Throttling follows every reading, scanning or not. */
+	iwn_tt_update(sc, sc->curtemp);
+
 	/* Ignore statistics received during a scan. */
 	if (vap->iv_state != IEEE80211_S_RUN ||
 	    (ic->ic_flags & IEEE80211_F_SCAN)){
@@ -2800,26 +4267,19 @@ iwn_rx_statistics(struct iwn_softc *sc, struct iwn_rx_desc *desc,
 		}
 	}
 
-	bus_dmamap_sync(sc->rxq.data_dmat, data->map, BUS_DMASYNC_POSTREAD);
-
 	DPRINTF(sc, IWN_DEBUG_CALIBRATE, "%s: received statistics, cmd %d\n",
 	    __func__, desc->type);
 	sc->calib_cnt = 0;	/* Reset TX power calibration timeout. */
 
-	/* Test if temperature has changed. */
-	if (stats->general.temp != sc->rawtemp) {
-		/* Convert "raw" temperature to degC. */
-		sc->rawtemp = stats->general.temp;
-		temp = ops->get_temperature(sc);
-		DPRINTF(sc, IWN_DEBUG_CALIBRATE, "%s: temperature %d\n",
-		    __func__, temp);
-
-		/* Update TX power if need be (4965AGN only). */
+	/*
+	 * Update TX power if need be (4965AGN only).  This compares against
+	 * the temperature of the last calibration, so changes seen while
+	 * scanning or not associated are caught up here.
+	 */
 #ifdef IWN_4965
-		if (sc->hw_type == IWN_HW_REV_TYPE_4965)
-			iwn4965_power_calibration(sc, temp);
+	if (sc->hw_type == IWN_HW_REV_TYPE_4965)
+		iwn4965_power_calibration(sc, sc->curtemp);
 #endif
-	}
 
 	if (desc->type != IWN_BEACON_STATISTICS)
 		return;	/* Reply to a statistics request. */
@@ -2834,14 +4294,6 @@ iwn_rx_statistics(struct iwn_softc *sc, struct iwn_rx_desc *desc,
 		return;
 	}
 
-	/*
-	 * XXX Differential gain calibration makes the 6005 firmware
-	 * crap out, so skip it for now.  This effectively disables
-	 * sensitivity tuning as well.
-	 */
-	if (sc->hw_type == IWN_HW_REV_TYPE_6005)
-		return;
-
 	if (calib->state == IWN_CALIB_STATE_ASSOC)
 		iwn_collect_noise(sc, &stats->rx.general);
 	else if (calib->state == IWN_CALIB_STATE_RUN)
@@ -2861,11 +4313,9 @@ iwn5000_tx_done(struct iwn_softc *sc, struct iwn_rx_desc *desc,
 	qid = desc->qid & 0xf;
 	ring = &sc->txq[qid];
 
-	DPRINTF(sc, IWN_DEBUG_XMIT, "%s: "
-	    "qid %d idx %d retries %d nkill %d rate %x ant %d duration %d status %x\n",
-	    __func__, desc->qid, desc->idx, stat->ackfailcnt,
-	    stat->btkillcnt, stat->rate, iwn_get_antenna(stat->rate),
-	    le16toh(stat->duration), le16toh(stat->status) & IWN_TX_STATUS_MSK);
+	IWN_TRACE(sc, IWN_EV_TX_DONE, desc->qid << 16 | desc->idx,
+	    le32toh(stat->rate), (le16toh(stat->status) & IWN_TX_STATUS_MSK) |
+	    stat->ackfailcnt << 16 | stat->btkillcnt << 24);
 #ifdef	IWN_DEBUG
 	iwn_print_rate(sc, stat->rate);
 #endif
@@ -2894,36 +4344,28 @@ iwn_tx_done(struct iwn_softc *sc, struct iwn_rx_desc *desc, int ackfailcnt,
 	struct ifnet *ifp = sc->sc_ifp;
 	struct iwn_tx_ring *ring = &sc->txq[desc->qid & IWN_RX_DESC_QID_MSK];
 	struct iwn_tx_data *data = &ring->data[desc->idx];
-
-	struct iwn_tx_cmd *cmd;
-	struct iwn_cmd_data *tx;
-
 	struct mbuf *m;
 	struct ieee80211_node *ni;
 	struct ieee80211vap *vap;
-	struct ieee80211_frame *wh;
 
 	KASSERT(data->ni != NULL, ("no node"));
 
 	DPRINTF(sc, IWN_DEBUG_TRACE | IWN_DEBUG_XMIT, "->%s begin\n", __func__);
+	IWN_TRACE(sc, IWN_EV_TX_STATUS, desc->qid << 16 | desc->idx, status,
+	    ackfailcnt);
+	SDT_PROBE4(iwn, , tx, done, desc->qid & IWN_RX_DESC_QID_MSK, desc->idx,
+	    status, ackfailcnt);
 
-	DPRINTF(sc, IWN_DEBUG_XMIT, "%s: qid %x\n", __func__,desc->qid); 
-	/* Unmap and free mbuf. */
-	uint8_t ridx;
+	/*
+	 * Unmap and free mbuf.  Only data[] is touched here; the TX
+	 * command and descriptor arrays stay out of the completion path.
+	 */
 	bus_dmamap_sync(ring->data_dmat, data->map, BUS_DMASYNC_POSTWRITE);
 	bus_dmamap_unload(ring->data_dmat, data->map);
 	m = data->m, data->m = NULL;
 	ni = data->ni, data->ni = NULL;
-	uint8_t type;
 	vap = ni->ni_vap;
 
-	cmd = &ring->cmd[desc->idx];
-	tx = (struct iwn_cmd_data *)cmd->data;
-	wh = (struct ieee80211_frame *)(tx + 1);
-
-	struct ieee80211com *ic = ni->ni_ic;
-
-	type = wh->i_fc[0] & IEEE80211_FC0_TYPE_MASK;
 	if (m->m_flags & M_TXCB) {
 		DPRINTF(sc, IWN_DEBUG_XMIT, "%s: M_TXCB found\n",__func__);
 		/*
@@ -2948,19 +4390,14 @@ iwn_tx_done(struct iwn_softc *sc, struct iwn_rx_desc *desc, int ackfailcnt,
 			    (status & IWN_TX_FAIL) != 0);
 	}
 
-	ridx = ic->ic_rt->rateCodeToIndex[ni->ni_txrate];
 	/*
 	 * Update rate control statistics for the node.
 	 */
 	if (status & IWN_TX_FAIL) {
-		DPRINTF(sc, IWN_DEBUG_XMIT, "%s: Status failed ackcnt: %d\n", 
-	    __func__, ackfailcnt);
 		ifp->if_oerrors++;
 		ieee80211_ratectl_tx_complete(vap, ni,
 		    IEEE80211_RATECTL_TX_FAILURE, &ackfailcnt, NULL);
 	} else {
-		DPRINTF(sc, IWN_DEBUG_XMIT, "%s: Status OK ackcnt: %d\n", 
-	    __func__, ackfailcnt);
 		ifp->if_opackets++;
 		ieee80211_ratectl_tx_complete(vap, ni,
 		    IEEE80211_RATECTL_TX_SUCCESS, &ackfailcnt, NULL);
@@ -2969,14 +4406,9 @@ iwn_tx_done(struct iwn_softc *sc, struct iwn_rx_desc *desc, int ackfailcnt,
 	ieee80211_free_node(ni);
 
 	sc->sc_tx_timer = 0;
-	if (--ring->queued < IWN_TX_RING_LOMARK) {
-		sc->qfullmsk &= ~(1 << ring->qid);
-		if (sc->qfullmsk == 0 &&
-		    (ifp->if_drv_flags & IFF_DRV_OACTIVE)) {
-			ifp->if_drv_flags &= ~IFF_DRV_OACTIVE;
-			iwn_start_locked(ifp);
-		}
-	}
+	if (iwn_txq_reclaimed(ring, 1) < IWN_TX_RING_LOMARK)
+		iwn_txq_clrfull(sc, ring);
+	iwn_tx_restart(sc);
 
 	DPRINTF(sc, IWN_DEBUG_TRACE | IWN_DEBUG_XMIT, "->%s: end\n",__func__);
 
@@ -3005,11 +4437,13 @@ iwn_cmd_done(struct iwn_softc *sc, struct iwn_rx_desc *desc)
 
 	if ((desc->qid & IWN_RX_DESC_QID_MSK) != cmd_queue_num)
 		return;	/* Not a command ack. */
+	SDT_PROBE2(iwn, , cmd, done, cmd_queue_num, desc->idx);
 
 	ring = &sc->txq[cmd_queue_num];
 	data = &ring->data[desc->idx];
 
 	/* If the command was mapped in an mbuf, free it. */
+	IWN_TXQ_LOCK(ring);
 	if (data->m != NULL) {
 		bus_dmamap_sync(ring->data_dmat, data->map,
 		    BUS_DMASYNC_POSTWRITE);
@@ -3017,6 +4451,7 @@ iwn_cmd_done(struct iwn_softc *sc, struct iwn_rx_desc *desc)
 		m_freem(data->m);
 		data->m = NULL;
 	}
+	IWN_TXQ_UNLOCK(ring);
 	wakeup(&ring->desc[desc->idx]);
 }
 
@@ -3025,7 +4460,6 @@ iwn_ampdu_tx_done(struct iwn_softc *sc, int qid, int idx, int nframes,
     void *stat)
 {
 	struct iwn_ops *ops = &sc->ops;
-	struct ifnet *ifp = sc->sc_ifp;
 	struct iwn_tx_ring *ring = &sc->txq[qid];
 	struct iwn_tx_data *data;
 	struct mbuf *m;
@@ -3037,7 +4471,8 @@ iwn_ampdu_tx_done(struct iwn_softc *sc, int qid, int idx, int nframes,
 	uint16_t *aggstatus = stat;
 	uint16_t ssn;
 	uint8_t tid;
-	int bit, i, lastidx, *res, seqno, shift, start;
+	int bit, i, lastidx, *res, seqno, shift, start, nreclaimed = 0;
+	int queued;
 
 	DPRINTF(sc, IWN_DEBUG_TRACE | IWN_DEBUG_XMIT, "->%s begin\n", __func__);
 
@@ -3105,28 +4540,28 @@ iwn_ampdu_tx_done(struct iwn_softc *sc, int qid, int idx, int nframes,
 		m_freem(m);
 		ieee80211_free_node(ni);
 
-		ring->queued--;
 		ring->read = (ring->read + 1) % IWN_TX_RING_COUNT;
+		nreclaimed++;
 	}
+	queued = iwn_txq_reclaimed(ring, nreclaimed);
+	if (queued < IWN_TX_RING_LOMARK)
+		iwn_txq_clrfull(sc, ring);
+	SDT_PROBE3(iwn, , tx, ampdu__done, qid, idx, nreclaimed);
 
-	if (ring->queued == 0 && res != NULL) {
+	if (queued == 0 && res != NULL) {
 		iwn_nic_lock(sc);
 		ops->ampdu_tx_stop(sc, qid, tid, ssn);
 		iwn_nic_unlock(sc);
+		/* Transmitters look up the ring through txa_private. */
+		IWN_TX_LOCK(sc);
 		sc->qid2tap[qid] = NULL;
-		free(res, M_DEVBUF);
+		tap->txa_private = NULL;
+		IWN_TX_UNLOCK(sc);
 		return;
 	}
 
 	sc->sc_tx_timer = 0;
-	if (ring->queued < IWN_TX_RING_LOMARK) {
-		sc->qfullmsk &= ~(1 << ring->qid);
-		if (sc->qfullmsk == 0 &&
-		    (ifp->if_drv_flags & IFF_DRV_OACTIVE)) {
-			ifp->if_drv_flags &= ~IFF_DRV_OACTIVE;
-			iwn_start_locked(ifp);
-		}
-	}
+	iwn_tx_restart(sc);
 
 	DPRINTF(sc, IWN_DEBUG_TRACE | IWN_DEBUG_XMIT, "->%s: end\n",__func__);
 
@@ -3145,11 +4580,21 @@ iwn_notif_intr(struct iwn_softc *sc)
 	struct ieee80211vap *vapscan = ss->ss_vap;
 
 	uint16_t hw;
+	int ndesc;
 
+	IWN_RX_LOCK(sc);
 	bus_dmamap_sync(sc->rxq.stat_dma.tag, sc->rxq.stat_dma.map,
 	    BUS_DMASYNC_POSTREAD);
 
+	/* BA and A-MPDU completions may each need NIC access. */
+	iwn_nic_batch_begin(sc);
+
 	hw = le16toh(sc->rxq.stat->closed_count) & 0xfff;
+	/* The firmware stops short of the 8-aligned write pointer. */
+	if ((hw - sc->rxq.cur + IWN_RX_RING_COUNT) % IWN_RX_RING_COUNT >=
+	    IWN_RX_RING_COUNT - 8)
+		sc->rxq.st_full++;
+	ndesc = 0;
 	while (sc->rxq.cur != hw) {
 		struct iwn_rx_data *data = &sc->rxq.data[sc->rxq.cur];
 		struct iwn_rx_desc *desc;
@@ -3158,11 +4603,8 @@ iwn_notif_intr(struct iwn_softc *sc)
 		    BUS_DMASYNC_POSTREAD);
 		desc = mtod(data->m, struct iwn_rx_desc *);
 
-		DPRINTF(sc, IWN_DEBUG_RECV,
-		    "%s: qid %x/%x idx %d flags %x type %d(%s) len %d\n",
-		    __func__, desc->qid, IWN_RX_RING_COUNT, desc->idx, desc->flags,
-		    desc->type, iwn_intr_str(desc->type),
-		    le16toh(desc->len));
+		IWN_TRACE(sc, IWN_EV_RX_DESC, desc->qid << 16 | desc->idx,
+		    desc->type, le32toh(desc->len));
 		if (le16toh(desc->len) == 8 && desc->qid == 0)
 			DPRINTF(sc, IWN_DEBUG_RECV, "%s: strange inter values: 0x%08x\n",
 		    __func__,le32toh(desc->len));
@@ -3236,9 +4678,11 @@ iwn_notif_intr(struct iwn_softc *sc)
 				if (misses > 5)
 					(void)iwn_init_sensitivity(sc);
 				if (misses >= iv_bmissthreshold) {
+					IWN_RX_UNLOCK(sc);
 					IWN_UNLOCK(sc);
 					ieee80211_beacon_miss(ic);
 					IWN_LOCK(sc);
+					IWN_RX_LOCK(sc);
 				}
 			}
 			break;
@@ -3274,8 +4718,20 @@ iwn_notif_intr(struct iwn_softc *sc)
 			}
 			/* Save the address of the error log in SRAM. */
 			sc->errptr = le32toh(uc->errptr);
+			/* Only the runtime firmware's event log is followed. */
+			sc->evtlog_ptr = 0;
+			if (uc->subtype != IWN_UCODE_INIT) {
+				sc->evtlog_ptr = le32toh(uc->logptr);
+				if (sc->evtlog_ptr == 0)
+					sc->evtlog_ptr = sc->evtlog_fwptr;
+			}
+			sc->evtlog_wraps = sc->evtlog_next = 0;
 			break;
 		}
+		case IWN_TEMP_NOTIFICATION:
+			/* Get the new reading through iwn_rx_statistics(). */
+			(void)iwn_set_statistics_request(sc, true, false, 1);
+			break;
 		case IWN_STATE_CHANGED:
 		{
 			uint32_t *status = (uint32_t *)(desc + 1);
@@ -3296,15 +4752,13 @@ iwn_notif_intr(struct iwn_softc *sc)
 				IWN_WRITE(sc, IWN_TARG_MBX_C, 0x00000004);
 			}
 			   
-			if(*status & IWN_STATE_CHANGE_CT_CARD_DISABLED) {
-				device_printf(sc->sc_dev,"critical temp. reached\n");
-				/* XXX: enter CT kill */
-			}
+			if(*status & IWN_STATE_CHANGE_CT_CARD_DISABLED)
+				iwn_ct_kill_enter(sc);
 		}  
-		if(!(*status & IWN_STATE_CHANGE_CT_CARD_DISABLED)){
-			callout_stop(&sc->ct_kill_exit_to);
-			/* XXX: exit CT kill */
-		}
+		/*
+		 * CT kill is left from iwn_tt_update() once the temperature
+		 * has dropped below IWN_CT_KILL_EXIT_THRESHOLD.
+		 */
 		/*
 		 * State change allows hardware switch change to be
 		 * noted. However, we handle this in iwn_intr as we
@@ -3326,6 +4780,9 @@ iwn_notif_intr(struct iwn_softc *sc)
 			    "%s: scanning channel %d status %x\n",
 			    __func__, scan->chan, le32toh(scan->status));
 #endif
+			SDT_PROBE2(iwn, , scan, start,
+			    ((struct iwn_start_scan *)(desc + 1))->chan,
+			    le32toh(((struct iwn_start_scan *)(desc + 1))->status));
 			break;
 		}
 		case IWN_STOP_SCAN:
@@ -3339,10 +4796,15 @@ iwn_notif_intr(struct iwn_softc *sc)
 			    "scan finished nchan=%d status=%d chan=%d\n",
 			    scan->nchan, scan->status, scan->chan);
 #endif
+			SDT_PROBE2(iwn, , scan, stop,
+			    ((struct iwn_stop_scan *)(desc + 1))->nchan,
+			    ((struct iwn_stop_scan *)(desc + 1))->status);
 
+			IWN_RX_UNLOCK(sc);
 			IWN_UNLOCK(sc);
 			ieee80211_scan_next(vapscan);
 			IWN_LOCK(sc);
+			IWN_RX_LOCK(sc);
 			break;
 		}
 		case IWN5000_CALIBRATION_RESULT:
@@ -3351,6 +4813,10 @@ iwn_notif_intr(struct iwn_softc *sc)
 
 		case IWN5000_CALIBRATION_DONE:
 			sc->sc_flags |= IWN_FLAG_CALIB_DONE;
+			/* Temperature band is keyed on the first reading. */
+			sc->calib_fwver = sc->fw_ver;
+			sc->calib_tband = IWN_CALIB_TBAND_UNKNOWN;
+			sc->calib_stamp = time_uptime;
 			wakeup(sc);
 			break;
 		default:
@@ -3359,11 +4825,16 @@ iwn_notif_intr(struct iwn_softc *sc)
 		}
 
 		sc->rxq.cur = (sc->rxq.cur + 1) % IWN_RX_RING_COUNT;
+		ndesc++;
 	}
+	iwn_nic_batch_end(sc);
+	sc->rxq.st_desc += ndesc;
+	sc->rxq.st_batch[iwn_ring_hist(ndesc)]++;
 
 	/* Tell the firmware what we have processed. */
 	hw = (hw == 0) ? IWN_RX_RING_COUNT - 1 : hw - 1;
 	IWN_WRITE(sc, IWN_FH_RX_WPTR, hw & ~7);
+	IWN_RX_UNLOCK(sc);
 }
 
 /*
@@ -3403,6 +4874,124 @@ iwn_rftoggle_intr(struct iwn_softc *sc)
 		ieee80211_runtask(ic, &sc->sc_radiooff_task);
 }
 
+/* CSR registers worth looking at after a firmware error. */
+static const uint32_t iwn_csr_tbl[] = {
+	IWN_HW_IF_CONFIG,
+	IWN_INT_COALESCING,
+	IWN_INT,
+	IWN_INT_MASK,
+	IWN_FH_INT,
+	IWN_GPIO_IN,
+	IWN_RESET,
+	IWN_GP_CNTRL,
+	IWN_HW_REV,
+	IWN_EEPROM,
+	IWN_EEPROM_GP,
+	IWN_OTP_GP,
+	IWN_GIO,
+	IWN_GP_UCODE,
+	IWN_GP_DRIVER,
+	IWN_UCODE_GP1,
+	IWN_UCODE_GP2,
+	IWN_LED,
+	IWN_DRAM_INT_TBL,
+	IWN_GIO_CHICKEN,
+	IWN_ANA_PLL,
+	IWN_HW_REV_WA,
+	IWN_DBG_HPET_MEM,
+};
+CTASSERT(nitems(iwn_csr_tbl) == IWN_CRASH_NCSR);
+
+/*
+ * Fill the preallocated crash dump: registers and driver ring state
+ * first, as they don't need the MAC awake, then the error log, the
+ * scheduler context and the tail of the event log from SRAM.
+ */
+static void
+iwn_crash_capture(struct iwn_softc *sc)
+{
+	struct iwn_crashdump *cd = sc->crash;
+	struct iwn_tx_ring *ring;
+	uint32_t base;
+	u_int cap, esz, first, i, n, start;
+
+	IWN_LOCK_ASSERT(sc);
+
+	memset(cd, 0, sizeof (*cd));
+	cd->version = IWN_CRASH_VERSION;
+	cd->size = sizeof (*cd);
+	cd->fw_ver = sc->fw_ver;
+	cd->tsc = get_cyclecount();
+	cd->uptime = time_uptime;
+	cd->hw_type = sc->hw_type;
+
+	for (i = 0; i < nitems(iwn_csr_tbl); i++)
+		cd->csr[i] = IWN_READ(sc, iwn_csr_tbl[i]);
+
+	cd->rxcur = sc->rxq.cur;
+	cd->ntxqs = sc->ntxqs;
+	for (i = 0; i < sc->ntxqs; i++) {
+		ring = &sc->txq[i];
+		cd->txq[i].cur = ring->cur;
+		cd->txq[i].read = ring->read;
+		cd->txq[i].queued = ring->queued;
+		if (ring->desc != NULL)
+			cd->txq[i].flags |= IWN_CRASH_TXQ_ALLOC;
+		if (sc->qid2tap[i] != NULL)
+			cd->txq[i].flags |= IWN_CRASH_TXQ_AGG;
+	}
+
+	n = MIN(sc->cmdhist_cur, IWN_CMD_HIST);
+	for (i = 0; i < n; i++)
+		cd->cmds[i] = sc->cmdhist[(sc->cmdhist_cur - n + i) &
+		    (IWN_CMD_HIST - 1)];
+	cd->ncmds = n;
+
+	if (iwn_nic_lock(sc) != 0)
+		goto done;
+	if (sc->errptr >= IWN_FW_DATA_BASE &&
+	    sc->errptr + sizeof (cd->error) <=
+	    IWN_FW_DATA_BASE + sc->fw_data_maxsz) {
+		iwn_mem_read_region_4(sc, sc->errptr, (uint32_t *)&cd->error,
+		    sizeof (cd->error) / sizeof (uint32_t));
+		cd->flags |= IWN_CRASH_ERRLOG;
+	}
+	cd->flags |= IWN_CRASH_SRAM;
+	cd->sched_len = MIN(sc->sched_ctx_len, sizeof (cd->sched)) /
+	    sizeof (uint32_t);
+	iwn_mem_read_region_4(sc, sc->sched_base + sc->sched_ctx_off,
+	    cd->sched, cd->sched_len);
+
+	if (sc->evtlog_ptr >= IWN_FW_DATA_BASE &&
+	    sc->evtlog_ptr + sizeof (cd->evthdr) <=
+	    IWN_FW_DATA_BASE + sc->fw_data_maxsz) {
+		iwn_mem_read_region_4(sc, sc->evtlog_ptr,
+		    (uint32_t *)&cd->evthdr,
+		    sizeof (cd->evthdr) / sizeof (uint32_t));
+		cap = iwn_evtlog_cap(sc, &cd->evthdr, &esz);
+		if (cap != 0) {
+			/* The most recent entries, oldest first. */
+			n = (cd->evthdr.wraps != 0) ? cap : cd->evthdr.next;
+			n = MIN(n, IWN_CRASH_EVENTS);
+			start = (cd->evthdr.next + cap - n) % cap;
+			first = MIN(n, cap - start);
+			base = sc->evtlog_ptr + sizeof (cd->evthdr);
+			iwn_mem_read_region_4(sc,
+			    base + start * esz * sizeof (uint32_t),
+			    cd->events, first * esz);
+			if (n > first)
+				iwn_mem_read_region_4(sc, base,
+				    cd->events + first * esz, (n - first) * esz);
+			cd->evtesz = esz;
+			cd->nevents = n;
+		}
+	}
+	iwn_nic_unlock(sc);
+
+done:	cd->magic = IWN_CRASH_MAGIC;
+	sc->crashes++;
+}
+
 /*
  * Dump the error log of the firmware when a firmware panic occurs.  Although
  * we can't debug the firmware because it is neither open source nor free, it
@@ -3416,8 +5005,13 @@ iwn_fatal_intr(struct iwn_softc *sc)
 
 	IWN_LOCK_ASSERT(sc);
 
-	/* Force a complete recalibration on next init. */
-	sc->sc_flags &= ~IWN_FLAG_CALIB_DONE;
+	iwn_crash_capture(sc);
+
+	/*
+	 * Calibration results are kept; iwn_calib_cache_check() decides on
+	 * next init whether they are still good enough to skip the INIT
+	 * firmware.
+	 */
 
 	/* Check that the error log address is valid. */
 	if (sc->errptr < IWN_FW_DATA_BASE ||
@@ -3436,6 +5030,10 @@ iwn_fatal_intr(struct iwn_softc *sc)
 	    sizeof (dump) / sizeof (uint32_t));
 	iwn_nic_unlock(sc);
 
+	/* Hand the events leading up to the crash to the reader. */
+	while (iwn_evtlog_poll(sc) > 0)
+		continue;
+
 	if (dump.valid == 0) {
 		printf("%s: firmware error log is empty\n", __func__);
 		return;
@@ -3455,14 +5053,278 @@ iwn_fatal_intr(struct iwn_softc *sc)
 	    dump.interrupt_link[0], dump.interrupt_link[1]);
 	printf("  time            = %u\n", dump.time[0]);
 
-	/* Dump driver status (TX and RX rings) while we're here. */
-	printf("driver status:\n");
-	for (i = 0; i < sc->ntxqs; i++) {
-		struct iwn_tx_ring *ring = &sc->txq[i];
-		printf("  tx ring %2d: qid=%-2d cur=%-3d queued=%-3d\n",
-		    i, ring->qid, ring->cur, ring->queued);
-	}
-	printf("  rx ring: cur=%d\n", sc->rxq.cur);
+	/* Dump driver status (TX and RX rings) while we're here. */
+	printf("driver status:\n");
+	for (i = 0; i < sc->ntxqs; i++) {
+		struct iwn_tx_ring *ring = &sc->txq[i];
+		printf("  tx ring %2d: qid=%-2d cur=%-3d queued=%-3d\n",
+		    i, ring->qid, ring->cur, ring->queued);
+	}
+	printf("  rx ring: cur=%d\n", sc->rxq.cur);
+}
+
+/*
+ * Number of entries the event log described by hdr can hold, bounded by
+ * the data SRAM; 0 if the header makes no sense.  *esz is set to the
+ * entry size in words.
+ */
+static u_int
+iwn_evtlog_cap(struct iwn_softc *sc, const struct iwn_fw_evtlog_hdr *hdr,
+    u_int *esz)
+{
+	uint32_t base = sc->evtlog_ptr + sizeof (*hdr);
+	u_int cap;
+
+	*esz = (hdr->mode == IWN_EVTLOG_MODE_NOTIME) ? 2 : 3;
+	cap = hdr->capacity;
+	if (sc->evtlog_fwsize != 0)
+		cap = MIN(cap, sc->evtlog_fwsize);
+	cap = MIN(cap, (IWN_FW_DATA_BASE + sc->fw_data_maxsz - base) /
+	    (*esz * sizeof (uint32_t)));
+	return (hdr->next < cap) ? cap : 0;
+}
+
+/*
+ * Copy entries the firmware added to its event log since the last call
+ * into the host ring, at most IWN_EVTLOG_BATCH at a time with one bulk
+ * SRAM read per contiguous run.  Returns how many entries are left.
+ */
+static int
+iwn_evtlog_poll(struct iwn_softc *sc)
+{
+	struct iwn_fw_evtlog_hdr hdr;
+	struct iwn_evtlog_ent *ent;
+	uint64_t behind, tsc;
+	uint32_t base, *p;
+	u_int cap, esz, first, i, n;
+
+	IWN_LOCK_ASSERT(sc);
+
+	if (sc->evtlog == NULL || sc->evtlog_ptr < IWN_FW_DATA_BASE ||
+	    sc->evtlog_ptr + sizeof (hdr) > IWN_FW_DATA_BASE +
+	    sc->fw_data_maxsz)
+		return 0;
+	if (iwn_nic_lock(sc) != 0)
+		return 0;
+	iwn_mem_read_region_4(sc, sc->evtlog_ptr, (uint32_t *)&hdr,
+	    sizeof (hdr) / sizeof (uint32_t));
+
+	base = sc->evtlog_ptr + sizeof (hdr);
+	if ((cap = iwn_evtlog_cap(sc, &hdr, &esz)) == 0) {
+		iwn_nic_unlock(sc);
+		return 0;
+	}
+
+	if (hdr.wraps < sc->evtlog_wraps || (hdr.wraps == sc->evtlog_wraps &&
+	    hdr.next < sc->evtlog_next)) {
+		/* The log was restarted behind our back. */
+		sc->evtlog_wraps = sc->evtlog_next = 0;
+	}
+	behind = (uint64_t)(hdr.wraps - sc->evtlog_wraps) * cap + hdr.next -
+	    sc->evtlog_next;
+	if (behind > cap) {
+		/* The firmware lapped us; skip to the oldest entry left. */
+		sc->evtlog_lost += behind - cap;
+		sc->evtlog_seq += behind - cap;
+		sc->evtlog_wraps = hdr.wraps - 1;
+		sc->evtlog_next = hdr.next;
+		behind = cap;
+	}
+	n = MIN(behind, IWN_EVTLOG_BATCH);
+	first = MIN(n, cap - sc->evtlog_next);
+	iwn_mem_read_region_4(sc,
+	    base + sc->evtlog_next * esz * sizeof (uint32_t),
+	    sc->evtlog_buf, first * esz);
+	if (n > first)
+		iwn_mem_read_region_4(sc, base, sc->evtlog_buf + first * esz,
+		    (n - first) * esz);
+	iwn_nic_unlock(sc);
+
+	sc->evtlog_next += n;
+	if (sc->evtlog_next >= cap) {
+		sc->evtlog_next -= cap;
+		sc->evtlog_wraps++;
+	}
+
+	tsc = get_cyclecount();
+	for (i = 0, p = sc->evtlog_buf; i < n; i++, p += esz) {
+		ent = &sc->evtlog[sc->evtlog_prod++ & (IWN_EVTLOG_COUNT - 1)];
+		ent->tsc = tsc;
+		ent->seq = sc->evtlog_seq++;
+		ent->id = p[0];
+		ent->time = (esz == 3) ? p[1] : 0;
+		ent->data = p[esz - 1];
+	}
+	if (sc->evtlog_prod - sc->evtlog_cons > IWN_EVTLOG_COUNT) {
+		/* Reader too slow; drop the oldest records. */
+		sc->evtlog_lost += sc->evtlog_prod - sc->evtlog_cons -
+		    IWN_EVTLOG_COUNT;
+		sc->evtlog_cons = sc->evtlog_prod - IWN_EVTLOG_COUNT;
+	}
+	sc->evtlog_events += n;
+	if (n != 0)
+		wakeup(&sc->evtlog_prod);
+	return behind - n;
+}
+
+static void
+iwn_evtlog_timeout(void *arg)
+{
+	struct iwn_softc *sc = arg;
+	struct ifnet *ifp = sc->sc_ifp;
+	int left = 0, to;
+
+	if (ifp->if_drv_flags & IFF_DRV_RUNNING)
+		left = iwn_evtlog_poll(sc);
+	/* Come back right away if the batch limit left entries behind. */
+	to = left ? 1 : MAX(msecs_to_ticks(sc->evtlog_interval), 1);
+	callout_reset(&sc->evtlog_to, to, iwn_evtlog_timeout, sc);
+}
+
+/*
+ * The evtlog device has a single reader; collection runs while it is
+ * open.  Reads return whole struct iwn_evtlog_ent records and block
+ * until at least one is available, unless O_NONBLOCK is set.
+ */
+static int
+iwn_evtlog_open(struct cdev *dev, int oflags, int devtype, struct thread *td)
+{
+	struct iwn_softc *sc = dev->si_drv1;
+	struct iwn_evtlog_ent *ring;
+	uint32_t *buf;
+
+	ring = malloc(IWN_EVTLOG_COUNT * sizeof (*ring), M_DEVBUF,
+	    M_WAITOK | M_ZERO);
+	buf = malloc(IWN_EVTLOG_BATCH * 3 * sizeof (uint32_t), M_DEVBUF,
+	    M_WAITOK);
+	IWN_LOCK(sc);
+	if (sc->evtlog != NULL || sc->evtlog_gone) {
+		IWN_UNLOCK(sc);
+		free(ring, M_DEVBUF);
+		free(buf, M_DEVBUF);
+		return EBUSY;
+	}
+	sc->evtlog = ring;
+	sc->evtlog_buf = buf;
+	sc->evtlog_prod = sc->evtlog_cons = 0;
+	callout_reset(&sc->evtlog_to, 1, iwn_evtlog_timeout, sc);
+	IWN_UNLOCK(sc);
+	return 0;
+}
+
+static int
+iwn_evtlog_close(struct cdev *dev, int fflag, int devtype, struct thread *td)
+{
+	struct iwn_softc *sc = dev->si_drv1;
+	struct iwn_evtlog_ent *ring;
+	uint32_t *buf;
+
+	IWN_LOCK(sc);
+	callout_stop(&sc->evtlog_to);
+	ring = sc->evtlog;
+	buf = sc->evtlog_buf;
+	sc->evtlog = NULL;
+	sc->evtlog_buf = NULL;
+	IWN_UNLOCK(sc);
+	free(ring, M_DEVBUF);
+	free(buf, M_DEVBUF);
+	return 0;
+}
+
+static int
+iwn_evtlog_read(struct cdev *dev, struct uio *uio, int ioflag)
+{
+	struct iwn_softc *sc = dev->si_drv1;
+	struct iwn_evtlog_ent buf[16];
+	u_int i, n;
+	int error = 0;
+
+	if (uio->uio_resid < (ssize_t)sizeof (buf[0]))
+		return EINVAL;
+
+	IWN_LOCK(sc);
+	while (sc->evtlog_prod == sc->evtlog_cons) {
+		if (sc->evtlog_gone) {
+			error = ENXIO;
+			goto out;
+		}
+		if (ioflag & O_NONBLOCK) {
+			error = EWOULDBLOCK;
+			goto out;
+		}
+		error = msleep(&sc->evtlog_prod, &sc->sc_mtx, PCATCH,
+		    "iwnlog", 0);
+		if (error != 0)
+			goto out;
+	}
+	while (error == 0 && sc->evtlog_prod != sc->evtlog_cons &&
+	    uio->uio_resid >= (ssize_t)sizeof (buf[0])) {
+		n = MIN(sc->evtlog_prod - sc->evtlog_cons, nitems(buf));
+		n = MIN(n, uio->uio_resid / sizeof (buf[0]));
+		for (i = 0; i < n; i++)
+			buf[i] = sc->evtlog[(sc->evtlog_cons + i) &
+			    (IWN_EVTLOG_COUNT - 1)];
+		sc->evtlog_cons += n;
+		IWN_UNLOCK(sc);
+		error = uiomove(buf, n * sizeof (buf[0]), uio);
+		IWN_LOCK(sc);
+	}
+out:
+	IWN_UNLOCK(sc);
+	return error;
+}
+
+/*
+ * Collect and acknowledge pending ICT entries, OR-ing them into *raw
+ * (little-endian, as written by the device); returns how many there
+ * were.  The device fills entries in order, so the run ends at the
+ * first zero; entries are scanned a cache line at a time and each
+ * line's run is cleared with one store burst.
+ */
+static u_int
+iwn_ict_drain(struct iwn_softc *sc, uint32_t *raw)
+{
+	uint32_t tmp = 0;
+	u_int cur, end, i, n = 0;
+
+	bus_dmamap_sync(sc->ict_dma.tag, sc->ict_dma.map,
+	    BUS_DMASYNC_POSTREAD | BUS_DMASYNC_POSTWRITE);
+	cur = sc->ict_cur;
+	while (n < IWN_ICT_COUNT) {
+		end = roundup2(cur + 1, IWN_ICT_PER_LINE);
+		for (i = cur; i < end && sc->ict[i] != 0; i++)
+			tmp |= sc->ict[i];
+		if (i == cur)
+			break;
+		memset(&sc->ict[cur], 0, (i - cur) * sizeof (uint32_t));
+		n += i - cur;
+		cur = i % IWN_ICT_COUNT;
+		if (i < end)
+			break;
+	}
+	sc->ict_cur = cur;
+	bus_dmamap_sync(sc->ict_dma.tag, sc->ict_dma.map,
+	    BUS_DMASYNC_PREREAD | BUS_DMASYNC_PREWRITE);
+
+	sc->ict_hist[iwn_ring_hist(n)]++;
+	*raw = tmp;
+	return n;
+}
+
+/*
+ * Clear the ICT and have the device start over at its first entry.
+ */
+static void
+iwn_ict_rewind(struct iwn_softc *sc)
+{
+	memset(sc->ict, 0, IWN_ICT_SIZE);
+	bus_dmamap_sync(sc->ict_dma.tag, sc->ict_dma.map,
+	    BUS_DMASYNC_PREREAD | BUS_DMASYNC_PREWRITE);
+	sc->ict_cur = 0;
+
+	/* Set physical address of ICT table (4KB aligned). */
+	IWN_WRITE(sc, IWN_DRAM_INT_TBL, IWN_DRAM_INT_TBL_ENABLE |
+	    IWN_DRAM_INT_TBL_WRAP_CHECK | sc->ict_dma.paddr >> 12);
 }
 
 static void
@@ -3471,20 +5333,18 @@ iwn_intr(void *arg)
 	struct iwn_softc *sc = arg;
 	struct ifnet *ifp = sc->sc_ifp;
 	uint32_t r1, r2, tmp;
+	int n, opath;
 
 	IWN_LOCK(sc);
+	opath = iwn_regpath_enter(sc, IWN_REGPATH_INTR);
+	SDT_PROBE(iwn, , intr, entry, 0, 0, 0, 0, 0);
 
 	/* Disable interrupts. */
 	IWN_WRITE(sc, IWN_INT_MASK, 0);
 
 	/* Read interrupts from ICT (fast) or from registers (slow). */
 	if (sc->sc_flags & IWN_FLAG_USE_ICT) {
-		tmp = 0;
-		while (sc->ict[sc->ict_cur] != 0) {
-			tmp |= sc->ict[sc->ict_cur];
-			sc->ict[sc->ict_cur] = 0;	/* Acknowledge. */
-			sc->ict_cur = (sc->ict_cur + 1) % IWN_ICT_COUNT;
-		}
+		n = iwn_ict_drain(sc, &tmp);
 		tmp = le32toh(tmp);
 		if (tmp == 0xffffffff)	/* Shouldn't happen. */
 			tmp = 0;
@@ -3492,10 +5352,29 @@ iwn_intr(void *arg)
 			tmp |= 0x8000;
 		r1 = (tmp & 0xff00) << 16 | (tmp & 0xff);
 		r2 = 0;	/* Unused. */
+		if (n >= IWN_ICT_COUNT) {
+			/*
+			 * Every entry was set: the device wrapped around
+			 * and may have overwritten causes we never saw.
+			 * The cause register still has all of them.
+			 */
+			sc->ict_overflows++;
+			tmp = IWN_READ(sc, IWN_INT);
+			if (tmp != 0xffffffff)
+				r1 |= tmp;
+			/*
+			 * Our position no longer matches the device's;
+			 * realign both before the next interrupt.
+			 */
+			iwn_ict_rewind(sc);
+		}
 	} else {
 		r1 = IWN_READ(sc, IWN_INT);
-		if (r1 == 0xffffffff || (r1 & 0xfffffff0) == 0xa5a5a5a0)
+		if (r1 == 0xffffffff || (r1 & 0xfffffff0) == 0xa5a5a5a0) {
+			iwn_regpath_leave(sc, opath);
+			IWN_UNLOCK(sc);
 			return;	/* Hardware gone! */
+		}
 		r2 = IWN_READ(sc, IWN_FH_INT);
 	}
 
@@ -3509,16 +5388,14 @@ iwn_intr(void *arg)
 		IWN_WRITE(sc, IWN_FH_INT, r2);
 
 
-	DPRINTF(sc, IWN_DEBUG_INTR, "Acked interupt reg1=0x%08x reg2=0x%08x\n", r1, r2);
+	IWN_TRACE(sc, IWN_EV_INTR, r1, r2, 0);
 
 	if (r1 & IWN_INT_RF_TOGGLED) {
 		iwn_rftoggle_intr(sc);
 		goto done;
 	}
-	if (r1 & IWN_INT_CT_REACHED) {
-		device_printf(sc->sc_dev, "%s: critical temperature reached!\n",
-		    __func__);
-	}
+	if (r1 & IWN_INT_CT_REACHED)
+		iwn_ct_kill_enter(sc);
 	/* Todo : Make separate action for HW Error and SW_error. SW Error maybe require just a restart */
 	if (r1 & (IWN_INT_SW_ERR | IWN_INT_HW_ERR)) {
 		device_printf(sc->sc_dev, "%s: fatal firmware error\n",
@@ -3526,11 +5403,11 @@ iwn_intr(void *arg)
 #ifdef	IWN_DEBUG
 		iwn_debug_register(sc);
 #endif
-		/* Dump firmware error log and stop. */
+		/* Dump firmware error log and restart the firmware. */
 		iwn_fatal_intr(sc);
-		ifp->if_flags &= ~IFF_UP;
-		iwn_stop_locked(sc);
-		goto done;
+		ieee80211_runtask(ifp->if_l2com, &sc->sc_restart_task);
+		/* Leave interrupts masked until the restart task runs. */
+		goto out;
 	}
 	if ((r1 & (IWN_INT_FH_RX | IWN_INT_SW_RX | IWN_INT_RX_PERIODIC)) ||
 	    (r2 & IWN_FH_INT_RX)) {
@@ -3551,7 +5428,10 @@ iwn_intr(void *arg)
 	if ((r1 & IWN_INT_FH_TX) || (r2 & IWN_FH_INT_TX)) {
 		if (sc->sc_flags & IWN_FLAG_USE_ICT)
 			IWN_WRITE(sc, IWN_FH_INT, IWN_FH_INT_TX);
-		wakeup(sc);	/* FH DMA transfer completed. */
+		/* FH DMA transfer completed. */
+		sc->fw_dma_done = 1;
+		wakeup(&sc->fw_dma_done);
+		wakeup(sc);
 	}
 
 	if (r1 & IWN_INT_ALIVE)
@@ -3564,7 +5444,9 @@ done:
 	/* Re-enable interrupts. */
 	if (ifp->if_flags & IFF_UP)
 		IWN_WRITE(sc, IWN_INT_MASK, sc->int_mask);
-
+out:
+	SDT_PROBE2(iwn, , intr, exit, r1, r2);
+	iwn_regpath_leave(sc, opath);
 	IWN_UNLOCK(sc);
 }
 
@@ -3625,13 +5507,14 @@ iwn_tx_data(struct iwn_softc *sc, struct mbuf *m, struct ieee80211_node *ni)
 	uint16_t qos;
 	u_int hdrlen;
 	bus_dma_segment_t *seg, segs[IWN_MAX_SCATTER];
+	bus_addr_t paddr;
 	uint8_t tid, ridx, txant, type;
 	int ac, i, totlen, error, pad, nsegs = 0, rate;
 	struct iwn_vap *ivp = IWN_VAP(vap);
 
 	DPRINTF(sc, IWN_DEBUG_TRACE | IWN_DEBUG_XMIT, "->%s begin\n", __func__);
 
-	IWN_LOCK_ASSERT(sc);
+	IWN_TX_LOCK_ASSERT(sc);
 
 	wh = mtod(m, struct ieee80211_frame *);
 	hdrlen = ieee80211_anyhdrsize(wh);
@@ -3701,6 +5584,7 @@ iwn_tx_data(struct iwn_softc *sc, struct mbuf *m, struct ieee80211_node *ni)
 	totlen = m->m_pkthdr.len;
 
 	if (ieee80211_radiotap_active_vap(vap)) {
+		/* XXX sc_txtap is shared between rings; the TX lock covers it. */
 		struct iwn_tx_radiotap_header *tap = &sc->sc_txtap;
 
 		tap->wt_flags = 0;
@@ -3810,8 +5694,8 @@ iwn_tx_data(struct iwn_softc *sc, struct mbuf *m, struct ieee80211_node *ni)
 		flags |= IWN_TX_LINKQ;	/* enable MRR */
 	}
 	/* Set physical address of "scratch area". */
-	tx->loaddr = htole32(IWN_LOADDR(data->scratch_paddr));
-	tx->hiaddr = IWN_HIADDR(data->scratch_paddr);
+	tx->loaddr = htole32(IWN_LOADDR(IWN_TX_SCRATCH_PADDR(ring, ring->cur)));
+	tx->hiaddr = IWN_HIADDR(IWN_TX_SCRATCH_PADDR(ring, ring->cur));
 
 	/* Copy 802.11 header in TX command. */
 	memcpy((uint8_t *)(tx + 1), wh, hdrlen);
@@ -3853,8 +5737,10 @@ iwn_tx_data(struct iwn_softc *sc, struct mbuf *m, struct ieee80211_node *ni)
 	data->m = m;
 	data->ni = ni;
 
-	DPRINTF(sc, IWN_DEBUG_XMIT, "%s: qid %d idx %d len %d nsegs %d\n",
-	    __func__, ring->qid, ring->cur, m->m_pkthdr.len, nsegs);
+	IWN_TRACE(sc, IWN_EV_TX, ring->qid << 16 | ring->cur,
+	    m->m_pkthdr.len, nsegs);
+	SDT_PROBE4(iwn, , tx, data, ring->qid, ring->cur, m->m_pkthdr.len,
+	    le32toh(tx->rate));
 #ifdef	IWN_DEBUG
 	iwn_print_rate(sc, le32toh(tx->rate));
 #endif
@@ -3863,8 +5749,9 @@ iwn_tx_data(struct iwn_softc *sc, struct mbuf *m, struct ieee80211_node *ni)
 	if (m->m_len != 0)
 		desc->nsegs += nsegs;
 	/* First DMA segment is used by the TX command. */
-	desc->segs[0].addr = htole32(IWN_LOADDR(data->cmd_paddr));
-	desc->segs[0].len  = htole16(IWN_HIADDR(data->cmd_paddr) |
+	paddr = IWN_TX_CMD_PADDR(ring, ring->cur);
+	desc->segs[0].addr = htole32(IWN_LOADDR(paddr));
+	desc->segs[0].len  = htole16(IWN_HIADDR(paddr) |
 	    (4 + sizeof (*tx) + hdrlen + pad) << 4);
 	/* Other DMA segments are for data payload. */
 	seg = &segs[0];
@@ -3885,14 +5772,18 @@ iwn_tx_data(struct iwn_softc *sc, struct mbuf *m, struct ieee80211_node *ni)
 	if (ring->qid >= sc->firstaggqueue)
 		ops->update_sched(sc, ring->qid, ring->cur, tx->id, totlen);
 
-	/* Kick TX ring. */
+	/* Mark TX ring as full if we reach a certain threshold. */
+	iwn_txq_enqueued(sc, ring);
+
+	/*
+	 * Kick TX ring.  The slot must be fully written (including data->m
+	 * and data->ni, which the completion reads on another CPU) before
+	 * the firmware can see it.
+	 */
 	ring->cur = (ring->cur + 1) % IWN_TX_RING_COUNT;
+	wmb();
 	IWN_WRITE(sc, IWN_HBUS_TARG_WRPTR, ring->qid << 8 | ring->cur);
 
-	/* Mark TX ring as full if we reach a certain threshold. */
-	if (++ring->queued > IWN_TX_RING_HIMARK)
-		sc->qfullmsk |= 1 << ring->qid;
-
 	DPRINTF(sc, IWN_DEBUG_TRACE  | IWN_DEBUG_XMIT, "->%s: end\n",__func__);
 
 	return 0;
@@ -3914,6 +5805,7 @@ iwn_tx_data_raw(struct iwn_softc *sc, struct mbuf *m,
 	struct iwn_tx_data *data;
 	struct mbuf *m1;
 	bus_dma_segment_t *seg, segs[IWN_MAX_SCATTER];
+	bus_addr_t paddr;
 	uint32_t flags;
 	u_int hdrlen;
 	int ac, totlen, error, pad, nsegs = 0, i, rate;
@@ -3921,7 +5813,7 @@ iwn_tx_data_raw(struct iwn_softc *sc, struct mbuf *m,
 	struct iwn_vap *ivp = IWN_VAP(vap);
 	DPRINTF(sc, IWN_DEBUG_TRACE | IWN_DEBUG_XMIT, "->%s begin\n", __func__);
 
-	IWN_LOCK_ASSERT(sc);
+	IWN_TX_LOCK_ASSERT(sc);
 
 	wh = mtod(m, struct ieee80211_frame *);
 	hdrlen = ieee80211_anyhdrsize(wh);
@@ -4007,6 +5899,7 @@ iwn_tx_data_raw(struct iwn_softc *sc, struct mbuf *m,
 		pad = 0;
 
 	if (ieee80211_radiotap_active_vap(vap)) {
+		/* XXX sc_txtap is shared between rings; the TX lock covers it. */
 		struct iwn_tx_radiotap_header *tap = &sc->sc_txtap;
 
 		tap->wt_flags = 0;
@@ -4035,8 +5928,8 @@ iwn_tx_data_raw(struct iwn_softc *sc, struct mbuf *m,
 	txant = IWN_LSB(sc->txchainmask);
 	tx->rate |= htole32(IWN_RFLAG_ANT(txant));
 	/* Set physical address of "scratch area". */
-	tx->loaddr = htole32(IWN_LOADDR(data->scratch_paddr));
-	tx->hiaddr = IWN_HIADDR(data->scratch_paddr);
+	tx->loaddr = htole32(IWN_LOADDR(IWN_TX_SCRATCH_PADDR(ring, ring->cur)));
+	tx->hiaddr = IWN_HIADDR(IWN_TX_SCRATCH_PADDR(ring, ring->cur));
 
 	/* Copy 802.11 header in TX command. */
 	memcpy((uint8_t *)(tx + 1), wh, hdrlen);
@@ -4078,16 +5971,19 @@ iwn_tx_data_raw(struct iwn_softc *sc, struct mbuf *m,
 	data->m = m;
 	data->ni = ni;
 
-	DPRINTF(sc, IWN_DEBUG_XMIT, "%s: qid %d idx %d len %d nsegs %d\n",
-	    __func__, ring->qid, ring->cur, m->m_pkthdr.len, nsegs);
+	IWN_TRACE(sc, IWN_EV_TX, ring->qid << 16 | ring->cur,
+	    m->m_pkthdr.len, nsegs);
+	SDT_PROBE4(iwn, , tx, data, ring->qid, ring->cur, m->m_pkthdr.len,
+	    le32toh(tx->rate));
 
 	/* Fill TX descriptor. */
 	desc->nsegs = 1;
 	if (m->m_len != 0)
 		desc->nsegs += nsegs;
 	/* First DMA segment is used by the TX command. */
-	desc->segs[0].addr = htole32(IWN_LOADDR(data->cmd_paddr));
-	desc->segs[0].len  = htole16(IWN_HIADDR(data->cmd_paddr) |
+	paddr = IWN_TX_CMD_PADDR(ring, ring->cur);
+	desc->segs[0].addr = htole32(IWN_LOADDR(paddr));
+	desc->segs[0].len  = htole16(IWN_HIADDR(paddr) |
 	    (4 + sizeof (*tx) + hdrlen + pad) << 4);
 	/* Other DMA segments are for data payload. */
 	seg = &segs[0];
@@ -4108,14 +6004,18 @@ iwn_tx_data_raw(struct iwn_softc *sc, struct mbuf *m,
 	if (ring->qid >= sc->firstaggqueue)
 		ops->update_sched(sc, ring->qid, ring->cur, tx->id, totlen);
 
-	/* Kick TX ring. */
+	/* Mark TX ring as full if we reach a certain threshold. */
+	iwn_txq_enqueued(sc, ring);
+
+	/*
+	 * Kick TX ring.  The slot must be fully written (including data->m
+	 * and data->ni, which the completion reads on another CPU) before
+	 * the firmware can see it.
+	 */
 	ring->cur = (ring->cur + 1) % IWN_TX_RING_COUNT;
+	wmb();
 	IWN_WRITE(sc, IWN_HBUS_TARG_WRPTR, ring->qid << 8 | ring->cur);
 
-	/* Mark TX ring as full if we reach a certain threshold. */
-	if (++ring->queued > IWN_TX_RING_HIMARK)
-		sc->qfullmsk |= 1 << ring->qid;
-
 	DPRINTF(sc, IWN_DEBUG_TRACE | IWN_DEBUG_XMIT, "->%s: end\n",__func__);
 
 	return 0;
@@ -4128,17 +6028,19 @@ iwn_raw_xmit(struct ieee80211_node *ni, struct mbuf *m,
 	struct ieee80211com *ic = ni->ni_ic;
 	struct ifnet *ifp = ic->ic_ifp;
 	struct iwn_softc *sc = ifp->if_softc;
-	int error = 0;
+	int error = 0, opath;
 
 	DPRINTF(sc, IWN_DEBUG_TRACE | IWN_DEBUG_XMIT, "->%s begin\n", __func__);
 
+	IWN_TX_LOCK(sc);
 	if ((ifp->if_drv_flags & IFF_DRV_RUNNING) == 0) {
+		IWN_TX_UNLOCK(sc);
 		ieee80211_free_node(ni);
 		m_freem(m);
 		return ENETDOWN;
 	}
 
-	IWN_LOCK(sc);
+	opath = iwn_regpath_enter(sc, IWN_REGPATH_TX);
 	if (params == NULL) {
 		/*
 		 * Legacy path; interpret frame contents to decide
@@ -4152,6 +6054,7 @@ iwn_raw_xmit(struct ieee80211_node *ni, struct mbuf *m,
 		 */
 		error = iwn_tx_data_raw(sc, m, ni, params);
 	}
+	iwn_regpath_leave(sc, opath);
 	if (error != 0) {
 		/* NB: m is reclaimed on tx failure */
 		ieee80211_free_node(ni);
@@ -4159,21 +6062,50 @@ iwn_raw_xmit(struct ieee80211_node *ni, struct mbuf *m,
 	}
 	sc->sc_tx_timer = 5;
 
-	IWN_UNLOCK(sc);
+	IWN_TX_UNLOCK(sc);
 
 	DPRINTF(sc, IWN_DEBUG_TRACE | IWN_DEBUG_XMIT, "->%s: end\n",__func__);
 
 	return error;
 }
 
+/*
+ * Transmit entry points only take the TX lock; they may run concurrently
+ * with the interrupt handler, which holds the driver lock.
+ */
 static void
 iwn_start(struct ifnet *ifp)
 {
 	struct iwn_softc *sc = ifp->if_softc;
 
-	IWN_LOCK(sc);
+	IWN_TX_LOCK(sc);
 	iwn_start_locked(ifp);
-	IWN_UNLOCK(sc);
+	IWN_TX_UNLOCK(sc);
+}
+
+/*
+ * Restart transmission once no TX ring is above its high-water mark.
+ */
+static void
+iwn_tx_restart(struct iwn_softc *sc)
+{
+	struct ifnet *ifp = sc->sc_ifp;
+
+	/*
+	 * Pairs with the barrier in iwn_start_locked(): either we see
+	 * OACTIVE here or the producer sees the cleared qfullmsk bit.
+	 */
+	mb();
+	if (sc->qfullmsk != 0 || !(ifp->if_drv_flags & IFF_DRV_OACTIVE) ||
+	    sc->tt_state == IWN_TT_CTKILL)
+		return;
+
+	IWN_TX_LOCK(sc);
+	if (sc->qfullmsk == 0 && (ifp->if_drv_flags & IFF_DRV_OACTIVE)) {
+		ifp->if_drv_flags &= ~IFF_DRV_OACTIVE;
+		iwn_start_locked(ifp);
+	}
+	IWN_TX_UNLOCK(sc);
 }
 
 static void
@@ -4182,8 +6114,9 @@ iwn_start_locked(struct ifnet *ifp)
 	struct iwn_softc *sc = ifp->if_softc;
 	struct ieee80211_node *ni;
 	struct mbuf *m;
+	int error, opath;
 
-	IWN_LOCK_ASSERT(sc);
+	IWN_TX_LOCK_ASSERT(sc);
 
 	if ((ifp->if_drv_flags & IFF_DRV_RUNNING) == 0 ||
 	    (ifp->if_drv_flags & IFF_DRV_OACTIVE))
@@ -4192,13 +6125,20 @@ iwn_start_locked(struct ifnet *ifp)
 	for (;;) {
 		if (sc->qfullmsk != 0) {
 			ifp->if_drv_flags |= IFF_DRV_OACTIVE;
-			break;
+			/* A completion may have drained the ring meanwhile. */
+			mb();
+			if (sc->qfullmsk != 0)
+				break;
+			ifp->if_drv_flags &= ~IFF_DRV_OACTIVE;
 		}
 		IFQ_DRV_DEQUEUE(&ifp->if_snd, m);
 		if (m == NULL)
 			break;
 		ni = (struct ieee80211_node *)m->m_pkthdr.rcvif;
-		if (iwn_tx_data(sc, m, ni) != 0) {
+		opath = iwn_regpath_enter(sc, IWN_REGPATH_TX);
+		error = iwn_tx_data(sc, m, ni);
+		iwn_regpath_leave(sc, opath);
+		if (error != 0) {
 			ieee80211_free_node(ni);
 			ifp->if_oerrors++;
 			continue;
@@ -4236,6 +6176,11 @@ iwn_watchdog(void *arg)
 			ieee80211_scan_next(vapscan);
 	}
 
+	if (++sc->txq_idle_ticks >= 60) {
+		sc->txq_idle_ticks = 0;
+		iwn_txq_check_idle(sc, 0);
+	}
+
 	callout_reset(&sc->watchdog_to, hz, iwn_watchdog, sc);
 }
 
@@ -4292,6 +6237,7 @@ iwn_cmd(struct iwn_softc *sc, int code, const void *buf, int size, int async)
 	struct iwn_tx_desc *desc;
 	struct iwn_tx_data *data;
 	struct iwn_tx_cmd *cmd;
+	struct iwn_cmd_rec *rec;
 	struct mbuf *m;
 	bus_addr_t paddr;
 	int totlen, error,cmd_queue_num;
@@ -4303,8 +6249,11 @@ iwn_cmd(struct iwn_softc *sc, int code, const void *buf, int size, int async)
 
 	DPRINTF(sc, IWN_DEBUG_TRACE | IWN_DEBUG_CMD, "->%s begin\n", __func__);
 
-	if (async == 0)
+	if (async == 0) {
 		IWN_LOCK_ASSERT(sc);
+		/* msleep() below only drops the driver lock. */
+		mtx_assert(&sc->sc_rx_mtx, MA_NOTOWNED);
+	}
 
 	if(sc->sc_flags & IWN_FLAG_PAN_SUPPORT)
 		cmd_queue_num = IWN_PAN_CMD_QUEUE;
@@ -4313,28 +6262,34 @@ iwn_cmd(struct iwn_softc *sc, int code, const void *buf, int size, int async)
 
 	ring = &sc->txq[cmd_queue_num];
 
+	IWN_TXQ_LOCK(ring);
 	desc = &ring->desc[ring->cur];
 	data = &ring->data[ring->cur];
 	totlen = 4 + size;
 
 	if (size > sizeof cmd->data) {
 		/* Command is too large to fit in a descriptor. */
-		if (totlen > MCLBYTES)
+		if (size > IWN_CMD_MAXSZ) {
+			IWN_TXQ_UNLOCK(ring);
 			return EINVAL;
+		}
 		m = m_getjcl(M_DONTWAIT, MT_DATA, M_PKTHDR, MJUMPAGESIZE);
-		if (m == NULL)
+		if (m == NULL) {
+			IWN_TXQ_UNLOCK(ring);
 			return ENOMEM;
+		}
 		cmd = mtod(m, struct iwn_tx_cmd *);
 		error = bus_dmamap_load(ring->data_dmat, data->map, cmd,
 		    totlen, iwn_dma_map_addr, &paddr, BUS_DMA_NOWAIT);
 		if (error != 0) {
+			IWN_TXQ_UNLOCK(ring);
 			m_freem(m);
 			return error;
 		}
 		data->m = m;
 	} else {
 		cmd = &ring->cmd[ring->cur];
-		paddr = data->cmd_paddr;
+		paddr = IWN_TX_CMD_PADDR(ring, ring->cur);
 	}
 
 	cmd->code = code;
@@ -4362,8 +6317,17 @@ iwn_cmd(struct iwn_softc *sc, int code, const void *buf, int size, int async)
 	    BUS_DMASYNC_PREWRITE);
 
 	/* Kick command ring. */
+	SDT_PROBE4(iwn, , cmd, submit, code, ring->qid, ring->cur, size);
+	rec = &sc->cmdhist[sc->cmdhist_cur++ & (IWN_CMD_HIST - 1)];
+	rec->tsc = get_cyclecount();
+	rec->code = code;
+	rec->qid = ring->qid;
+	rec->idx = ring->cur;
+	rec->async = async;
+	rec->len = size;
 	ring->cur = (ring->cur + 1) % IWN_TX_RING_COUNT;
 	IWN_WRITE(sc, IWN_HBUS_TARG_WRPTR, ring->qid << 8 | ring->cur);
+	IWN_TXQ_UNLOCK(ring);
 
 	DPRINTF(sc, IWN_DEBUG_TRACE | IWN_DEBUG_CMD, "->%s: end\n",__func__);
 
@@ -4393,6 +6357,7 @@ iwn_set_link_quality(struct iwn_softc *sc, struct ieee80211_node *ni)
 #define	RV(v)	((v) & IEEE80211_RATE_VAL)
 	struct iwn_node *wn = (void *)ni;
 	struct ieee80211_rateset *rs = &ni->ni_rates;
+	const struct iwn_tt_restrict *tt = &iwn_tt_restrict[IWN_TT_NORMAL];
 	struct iwn_cmd_link_quality linkq;
 	uint8_t txant;
 	int i, rate, txrate;
@@ -4406,14 +6371,19 @@ iwn_set_link_quality(struct iwn_softc *sc, struct ieee80211_node *ni)
 	linkq.id = wn->id;
 	linkq.antmsk_1stream = txant;
 	linkq.antmsk_2stream = IWN_ANT_AB;
-	linkq.ampdu_max = 64;
+	/* Shorter aggregates and a single stream when running hot. */
+	if (sc->base_params->adv_thermal_throttle)
+		tt = &iwn_tt_restrict[sc->tt_state];
+	linkq.ampdu_max = tt->ampdu_max;
 	linkq.ampdu_threshold = 3;
-	linkq.ampdu_limit = htole16(4000);	/* 4ms */
+	linkq.ampdu_limit = htole16(tt->ampdu_limit);
 
 	/* Start at highest available bit-rate. */
-	if (IEEE80211_IS_CHAN_HT(ni->ni_chan))
+	if (IEEE80211_IS_CHAN_HT(ni->ni_chan)) {
 		txrate = ni->ni_htrates.rs_nrates - 1;
-	else
+		if (tt->siso)
+			txrate = MIN(txrate, 7);	/* MCS 0-7 */
+	} else
 		txrate = rs->rs_nrates - 1;
 	for (i = 0; i < IWN_MAX_TX_RETRIES; i++) {
 		uint32_t plcp;
@@ -4596,6 +6566,150 @@ iwn_set_critical_temp(struct iwn_softc *sc)
 	return iwn_cmd(sc, IWN_CMD_SET_CRITICAL_TEMP, &crit, sizeof crit, 0);
 }
 
+/*
+ * Map a temperature to a throttling state.  Thresholds are crossed
+ * upwards at their nominal value and downwards IWN_TT_HYST degrees
+ * lower, so a reading hovering around one doesn't flap.  CT kill is
+ * only left below IWN_CT_KILL_EXIT_THRESHOLD.
+ */
+static int
+iwn_tt_state(struct iwn_softc *sc, int temp)
+{
+	static const int thr[] = {
+		IWN_TT_LIGHT_THRESHOLD,
+		IWN_TT_MEDIUM_THRESHOLD,
+		IWN_TT_HEAVY_THRESHOLD,
+		IWN_CT_KILL_THRESHOLD
+	};
+	int lim, state;
+
+	if (sc->tt_state == IWN_TT_CTKILL &&
+	    temp >= IWN_CT_KILL_EXIT_THRESHOLD)
+		return IWN_TT_CTKILL;
+	for (state = IWN_TT_NORMAL; state < IWN_TT_CTKILL; state++) {
+		lim = thr[state];
+		if (state < sc->tt_state)
+			lim -= IWN_TT_HYST;
+		if (temp < lim)
+			break;
+	}
+	return state;
+}
+
+/*
+ * Thermal throttling: called with each temperature reading, moves to
+ * the matching state and applies its restrictions (iwn_tt_restrict[]).
+ * Power save and link quality are re-sent asynchronously since we may
+ * be called from the notification path.
+ */
+static void
+iwn_tt_update(struct iwn_softc *sc, int temp)
+{
+	struct ifnet *ifp = sc->sc_ifp;
+	struct ieee80211com *ic = ifp->if_l2com;
+	struct ieee80211vap *vap;
+	int ostate, state;
+
+	IWN_LOCK_ASSERT(sc);
+
+	ostate = sc->tt_state;
+	if ((state = iwn_tt_state(sc, temp)) == ostate)
+		return;
+
+	DPRINTF(sc, IWN_DEBUG_CALIBRATE,
+	    "%s: temperature %d, throttling state %d -> %d\n", __func__,
+	    temp, ostate, state);
+	if (state == IWN_TT_CTKILL) {
+		iwn_ct_kill_enter(sc);
+		return;
+	}
+	sc->tt_state = state;
+	sc->tt_transitions++;
+	if (ostate == IWN_TT_CTKILL && iwn_ct_kill_exit(sc) != 0)
+		return;
+
+	(void)iwn_set_pslevel(sc, IWN_POWERSAVE_DTIM_VOIP_COMPATIBLE,
+	    sc->desired_pwrsave_level, 1);
+	if (!sc->base_params->adv_thermal_throttle ||
+	    ic->ic_opmode == IEEE80211_M_MONITOR)
+		return;
+	TAILQ_FOREACH(vap, &ic->ic_vaps, iv_next) {
+		if (vap->iv_state == IEEE80211_S_RUN)
+			(void)iwn_set_link_quality(sc, vap->iv_bss);
+	}
+}
+
+/*
+ * The firmware stopped the RF at critical temperature.  Hold frames on
+ * the send queue and poll the temperature until it has cooled down.
+ */
+static void
+iwn_ct_kill_enter(struct iwn_softc *sc)
+{
+	struct ifnet *ifp = sc->sc_ifp;
+
+	IWN_LOCK_ASSERT(sc);
+
+	if (sc->tt_state == IWN_TT_CTKILL)
+		return;
+	device_printf(sc->sc_dev,
+	    "critical temperature reached (%dC), radio off\n", sc->curtemp);
+	sc->tt_state = IWN_TT_CTKILL;
+	sc->tt_transitions++;
+	sc->ct_kills++;
+
+	IWN_TX_LOCK(sc);
+	ifp->if_drv_flags |= IFF_DRV_OACTIVE;
+	IWN_TX_UNLOCK(sc);
+	sc->sc_tx_timer = 0;
+	callout_reset(&sc->ct_kill_exit_to, IWN_CT_KILL_EXIT_POLL * hz,
+	    iwn_ct_kill_exit_timeout, sc);
+}
+
+/*
+ * Leave CT kill.  Firmware that supports it resumes once we drop the
+ * CT kill bit; otherwise the adapter is reset.  Returns non-zero in
+ * the latter case.
+ */
+static int
+iwn_ct_kill_exit(struct iwn_softc *sc)
+{
+	struct ifnet *ifp = sc->sc_ifp;
+	struct ieee80211com *ic = ifp->if_l2com;
+
+	IWN_LOCK_ASSERT(sc);
+
+	callout_stop(&sc->ct_kill_exit_to);
+	device_printf(sc->sc_dev, "temperature down to %dC, radio on\n",
+	    sc->curtemp);
+	if (!sc->base_params->support_ct_kill_exit) {
+		ieee80211_runtask(ic, &sc->sc_reinit_task);
+		return 1;
+	}
+	IWN_WRITE(sc, IWN_UCODE_GP1_CLR, IWN_UCODE_GP1_CTEMP_STOP_RF);
+
+	IWN_TX_LOCK(sc);
+	if (ifp->if_drv_flags & IFF_DRV_OACTIVE) {
+		ifp->if_drv_flags &= ~IFF_DRV_OACTIVE;
+		iwn_start_locked(ifp);
+	}
+	IWN_TX_UNLOCK(sc);
+	return 0;
+}
+
+static void
+iwn_ct_kill_exit_timeout(void *arg)
+{
+	struct iwn_softc *sc = arg;
+
+	IWN_LOCK_ASSERT(sc);
+
+	/* The reading comes back through iwn_rx_statistics(). */
+	(void)iwn_set_statistics_request(sc, true, false, 1);
+	callout_reset(&sc->ct_kill_exit_to, IWN_CT_KILL_EXIT_POLL * hz,
+	    iwn_ct_kill_exit_timeout, sc);
+}
+
 static int
 iwn_set_timing(struct iwn_softc *sc, struct ieee80211_node *ni)
 {
@@ -4711,7 +6825,7 @@ iwn5000_get_temperature(struct iwn_softc *sc)
 		temp = IWN_KTOC(temp);
 	}
 	DPRINTF(sc,IWN_DEBUG_CALIBRATE,"Temperature %d\n",temp);
-	//XXX: handle thermal throttling state machine
+	/* Thermal throttling is driven from iwn_rx_statistics(). */
 	return temp;
 }
 
@@ -4746,13 +6860,30 @@ iwn_init_sensitivity(struct iwn_softc *sc)
 		return error;
 
 	/* Write initial gains. */
-	if ((error = ops->init_gains(sc)) != 0)
+	if (iwn_gain_calib_ok(sc) && (error = ops->init_gains(sc)) != 0)
 		return error;
 
 	/* Request statistics at each beacon interval. */
 	return iwn_set_statistics_request(sc,true,false,1);
 }
 
+/*
+ * Differential gain calibration makes the 6005 firmware crap out unless
+ * the firmware tells us (IWN_FW_TLV_PHY_CALIB) which PHY calibration
+ * opcodes it expects.  Without it, only sensitivity is tuned.
+ */
+static int
+iwn_gain_calib_ok(struct iwn_softc *sc)
+{
+	if (sc->hw_type != IWN_HW_REV_TYPE_6005 ||
+	    (sc->sc_flags & IWN_FLAG_PHY_CALIB_TLV))
+		return 1;
+	DPRINTF(sc, IWN_DEBUG_CALIBRATE,
+	    "%s: no PHY calibration TLV, skipping gain calibration\n",
+	    __func__);
+	return 0;
+}
+
 /*
  * Collect noise and RSSI statistics for the first 20 beacons received
  * after association and use them to determine connected antennas and
@@ -4797,7 +6928,8 @@ iwn_collect_noise(struct iwn_softc *sc,
 	if ((sc->chainmask & sc->txchainmask) == 0)
 		sc->chainmask |= IWN_LSB(sc->txchainmask);
 
-	(void)ops->set_gains(sc);
+	if (iwn_gain_calib_ok(sc))
+		(void)ops->set_gains(sc);
 	calib->state = IWN_CALIB_STATE_RUN;
 
 #ifdef notyet
@@ -4866,6 +6998,54 @@ iwn5000_set_gains(struct iwn_softc *sc)
 	return iwn_cmd(sc, IWN_CMD_PHY_CALIB, &cmd, sizeof cmd, 1);
 }
 
+/*
+ * Add a sample to a sliding window of the last ``len'' samples and
+ * return the window's maximum.
+ */
+static uint32_t
+iwn_swmax_push(struct iwn_swmax *w, uint32_t val, u_int len)
+{
+	uint32_t n = w->nsamples++;
+
+	KASSERT(len <= IWN_SWMAX_SIZE, ("%s: window too large", __func__));
+
+	/* Drop the oldest sample once it slides out of the window. */
+	if (w->count != 0 && n - w->seq[w->head] >= len) {
+		w->head = (w->head + 1) & (IWN_SWMAX_SIZE - 1);
+		w->count--;
+	}
+	/* Samples no larger than this one can never be the maximum again. */
+	while (w->count != 0 && w->val[(w->head + w->count - 1) &
+	    (IWN_SWMAX_SIZE - 1)] <= val)
+		w->count--;
+	w->val[(w->head + w->count) & (IWN_SWMAX_SIZE - 1)] = val;
+	w->seq[(w->head + w->count) & (IWN_SWMAX_SIZE - 1)] = n;
+	w->count++;
+	return w->val[w->head];
+}
+
+/*
+ * Step a sensitivity setting up (or down) by ``step'' without going past
+ * ``max'' (or ``min''); returns 1 if it was not already at the limit.
+ */
+static int
+iwn_calib_inc(uint32_t *val, uint32_t step, uint32_t max)
+{
+	if (*val >= max)
+		return 0;
+	*val = (*val < max - step) ? *val + step : max;
+	return 1;
+}
+
+static int
+iwn_calib_dec(uint32_t *val, uint32_t step, uint32_t min)
+{
+	if (*val <= min)
+		return 0;
+	*val = (*val > min + step) ? *val - step : min;
+	return 1;
+}
+
 /*
  * Tune RF RX sensitivity based on the number of false alarms detected
  * during the last beacon period.
@@ -4873,23 +7053,8 @@ iwn5000_set_gains(struct iwn_softc *sc)
 static void
 iwn_tune_sensitivity(struct iwn_softc *sc, const struct iwn_rx_stats *stats)
 {
-#define inc(val, inc, max)			\
-	if ((val) < (max)) {			\
-		if ((val) < (max) - (inc))	\
-			(val) += (inc);		\
-		else				\
-			(val) = (max);		\
-		needs_update = 1;		\
-	}
-#define dec(val, dec, min)			\
-	if ((val) > (min)) {			\
-		if ((val) > (min) + (dec))	\
-			(val) -= (dec);		\
-		else				\
-			(val) = (min);		\
-		needs_update = 1;		\
-	}
-
+#define inc(val, inc, max)	needs_update |= iwn_calib_inc(&(val), inc, max)
+#define dec(val, dec, min)	needs_update |= iwn_calib_dec(&(val), dec, min)
 	const struct iwn_sensitivity_limits *limits = sc->limits;
 	struct iwn_calib_state *calib = &sc->calib;
 	uint32_t val, rxena, fa;
@@ -4938,28 +7103,21 @@ iwn_tune_sensitivity(struct iwn_softc *sc, const struct iwn_rx_stats *stats)
 		noise[i] = (le32toh(stats->general.noise[i]) >> 8) & 0xff;
 	val = MAX(noise[0], noise[1]);
 	val = MAX(noise[2], val);
-	/* Insert it into our samples table. */
-	calib->noise_samples[calib->cur_noise_sample] = val;
-	calib->cur_noise_sample = (calib->cur_noise_sample + 1) % 20;
-
-	/* Compute maximum noise among last 20 samples. */
-	noise_ref = calib->noise_samples[0];
-	for (i = 1; i < 20; i++)
-		noise_ref = MAX(noise_ref, calib->noise_samples[i]);
+	/* Maximum noise among the last 20 samples. */
+	noise_ref = iwn_swmax_push(&calib->noise_max, val,
+	    IWN_CALIB_NOISE_WINDOW);
 
 	/* Compute maximum energy among 3 receivers. */
 	for (i = 0; i < 3; i++)
 		energy[i] = le32toh(stats->general.energy[i]);
 	val = MIN(energy[0], energy[1]);
 	val = MIN(energy[2], val);
-	/* Insert it into our samples table. */
-	calib->energy_samples[calib->cur_energy_sample] = val;
-	calib->cur_energy_sample = (calib->cur_energy_sample + 1) % 10;
-
-	/* Compute minimum energy among last 10 samples. */
-	energy_min = calib->energy_samples[0];
-	for (i = 1; i < 10; i++)
-		energy_min = MAX(energy_min, calib->energy_samples[i]);
+	/*
+	 * Minimum energy among the last 10 samples; the firmware reports
+	 * it negated, hence the maximum.
+	 */
+	energy_min = iwn_swmax_push(&calib->energy_max, val,
+	    IWN_CALIB_ENERGY_WINDOW);
 	energy_min += 6;
 
 	/* Compute number of false alarms since last call for CCK. */
@@ -5107,6 +7265,9 @@ iwn_set_pslevel(struct iwn_softc *sc, int dtim, int level, int async)
 		#endif
 	}
 
+	/* Thermal throttling duty-cycles the radio through power save. */
+	level = MAX(level, iwn_tt_restrict[sc->tt_state].pslevel);
+
 	DPRINTF(sc, IWN_DEBUG_PWRSAVE,
 	    "%s: dtim=%d, level=%d, async=%d\n",
 	    __func__,
@@ -5286,6 +7447,112 @@ iwn5000_runtime_calib(struct iwn_softc *sc)
 	return iwn_cmd(sc, IWN5000_CMD_CALIB_CONFIG, &cmd, sizeof(cmd), 0);
 }
 
+/*
+ * Return non-zero if going from the ``active'' RXON to the ``staging'' one
+ * needs a full RXON command.  Only the rates, rxchain and the flags and
+ * filter bits other than band and association can be changed through
+ * RXON_ASSOC, and only while associated.
+ */
+static int
+iwn_rxon_full_required(struct iwn_softc *sc, const struct iwn_rxon *staging,
+    const struct iwn_rxon *active)
+{
+	const uint32_t flagmsk = htole32(IWN_RXON_24GHZ);
+	const uint32_t filtmsk = htole32(IWN_FILTER_BSS);
+
+#ifdef	IWN_4965
+	/* The 4965 RXON_ASSOC layout differs; always use the full command. */
+	if (sc->hw_type == IWN_HW_REV_TYPE_4965)
+		return 1;
+#endif
+	if (!(active->filter & filtmsk))
+		return 1;
+	if (!IEEE80211_ADDR_EQ(staging->myaddr, active->myaddr) ||
+	    !IEEE80211_ADDR_EQ(staging->bssid, active->bssid) ||
+	    !IEEE80211_ADDR_EQ(staging->wlap, active->wlap))
+		return 1;
+	if (staging->mode != active->mode ||
+	    staging->air != active->air ||
+	    staging->chan != active->chan ||
+	    staging->associd != active->associd)
+		return 1;
+	if (staging->ht_single_mask != active->ht_single_mask ||
+	    staging->ht_dual_mask != active->ht_dual_mask ||
+	    staging->ht_triple_mask != active->ht_triple_mask)
+		return 1;
+	if ((staging->flags & flagmsk) != (active->flags & flagmsk) ||
+	    (staging->filter & filtmsk) != (active->filter & filtmsk))
+		return 1;
+	return 0;
+}
+
+/*
+ * Send the staging RXON of context ``ctx'' to the firmware, using the
+ * cheapest command that gets it there.  A full RXON resets the firmware
+ * station table and flushes the TX queues, so it is skipped entirely if
+ * nothing changed since the last accepted configuration and replaced by
+ * RXON_ASSOC when only association-time fields did.  On return *fullp
+ * (if not NULL) tells the caller whether a full RXON was sent and the
+ * node table, link quality and TX power must be set up again.
+ */
+static int
+iwn_rxon_commit(struct iwn_softc *sc, int ctx, int async, int *fullp)
+{
+	struct iwn_rxon *staging = &sc->rx_on[ctx];
+	struct iwn_rxon *active = &sc->rx_on_active[ctx];
+	struct iwn5000_rxon_assoc assoc;
+	int error, full;
+
+	if (fullp != NULL)
+		*fullp = 0;
+
+	if ((sc->rxon_valid & (1 << ctx)) &&
+	    memcmp(staging, active, sc->rxonsz) == 0) {
+		DPRINTF(sc, IWN_DEBUG_STATE, "%s: ctx %d RXON unchanged\n",
+		    __func__, ctx);
+		sc->rxon_skip_cnt++;
+		return 0;
+	}
+
+	full = !(sc->rxon_valid & (1 << ctx)) ||
+	    iwn_rxon_full_required(sc, staging, active);
+	if (full) {
+		error = iwn_cmd(sc, (ctx == IWN_RXON_PAN_CTX) ?
+		    IWN_CMD_WIPAN_RXON : IWN_CMD_RXON, staging, sc->rxonsz,
+		    async);
+	} else {
+		memset(&assoc, 0, sizeof assoc);
+		assoc.flags = staging->flags;
+		assoc.filter = staging->filter;
+		assoc.ofdm_mask = staging->ofdm_mask;
+		assoc.cck_mask = staging->cck_mask;
+		assoc.ht_single_mask = staging->ht_single_mask;
+		assoc.ht_dual_mask = staging->ht_dual_mask;
+		assoc.ht_triple_mask = staging->ht_triple_mask;
+		assoc.rxchain = staging->rxchain;
+		assoc.acquisition = staging->acquisition;
+		error = iwn_cmd(sc, (ctx == IWN_RXON_PAN_CTX) ?
+		    IWN_CMD_WIPAN_RXON_ASSOC : IWN_CMD_RXON_ASSOC, &assoc,
+		    sizeof assoc, async);
+	}
+	if (error != 0) {
+		sc->rxon_valid &= ~(1 << ctx);
+		return error;
+	}
+
+	DPRINTF(sc, IWN_DEBUG_STATE, "%s: ctx %d sent %s\n", __func__, ctx,
+	    full ? "RXON" : "RXON_ASSOC");
+	if (full)
+		sc->rxon_full_cnt++;
+	else
+		sc->rxon_assoc_cnt++;
+	memcpy(active, staging, sc->rxonsz);
+	sc->rxon_valid |= 1 << ctx;
+	if (fullp != NULL)
+		*fullp = full;
+	return 0;
+}
+
 static int
 iwn_config(struct iwn_softc *sc)
 {
@@ -5415,7 +7682,7 @@ iwn_config(struct iwn_softc *sc)
 	sc->rxon->rxchain = htole16(rxchain);
 
 	DPRINTF(sc, IWN_DEBUG_RESET, "%s: setting configuration\n", __func__);
-	error = iwn_cmd(sc, IWN_CMD_RXON, sc->rxon, sc->rxonsz, 0);
+	error = iwn_rxon_commit(sc, IWN_RXON_BSS_CTX, 0, NULL);
 	if (error != 0) {
 		device_printf(sc->sc_dev, "%s: RXON command failed\n",
 		    __func__);
@@ -5475,6 +7742,63 @@ ieee80211_add_ssid(uint8_t *frm, const uint8_t *ssid, u_int len)
 	return frm + len;
 }
 
+/*
+ * Return non-zero if there is enough traffic pending on the data rings that
+ * going off channel now would hurt more than a stale scan cache.
+ */
+static int
+iwn_bgscan_busy(struct iwn_softc *sc)
+{
+	int qid, cmd_queue_num, pending = 0;
+
+	if (sc->qfullmsk != 0)
+		return 1;
+
+	if (sc->sc_flags & IWN_FLAG_PAN_SUPPORT)
+		cmd_queue_num = IWN_PAN_CMD_QUEUE;
+	else
+		cmd_queue_num = IWN_CMD_QUEUE_NUM;
+
+	for (qid = 0; qid < sc->ntxqs; qid++) {
+		if (qid == cmd_queue_num)
+			continue;
+		pending += sc->txq[qid].queued;
+	}
+	return pending > sc->bgscan_busythr;
+}
+
+/*
+ * Fill the background scan fields of the scan header.  The firmware then
+ * sends a null frame with the PM bit set before leaving the home channel,
+ * never stays away longer than max_svc and returns home for pause_svc
+ * between dwells, so the AP buffers our traffic instead of dropping it.
+ */
+static void
+iwn_bgscan_setup(struct iwn_softc *sc, struct iwn_scan_hdr *hdr,
+    struct ieee80211_node *ni)
+{
+	uint32_t bintval, suspend;
+
+	bintval = ni->ni_intval;
+	if (bintval == 0)
+		bintval = IWN_BEACON_INTERVAL_DEFAULT;
+	suspend = sc->bgscan_suspend;
+
+	/* Times are in usec; the suspend time is in beacons and TUs. */
+	hdr->max_svc = htole32(sc->bgscan_maxout * 1024);
+	hdr->pause_svc = htole32(((suspend / bintval) << 22) |
+	    ((suspend % bintval) * 1024));
+
+	/* Leave a quiet channel sooner to cut the off-channel time. */
+	hdr->quiet_time = htole16(IWN_BGSCAN_QUIET_TIME);
+
+	sc->bgscan_cmds++;
+
+	DPRINTF(sc, IWN_DEBUG_STATE,
+	    "%s: max_svc %u pause_svc 0x%x bintval %u\n", __func__,
+	    le32toh(hdr->max_svc), le32toh(hdr->pause_svc), bintval);
+}
+
 static int
 iwn_scan(struct iwn_softc *sc)
 {
@@ -5540,6 +7864,9 @@ iwn_scan(struct iwn_softc *sc)
 	hdr->rxchain = htole16(rxchain);
 	hdr->filter = htole32(IWN_FILTER_MULTICAST | IWN_FILTER_BEACON);
 
+	if (vap->iv_state == IEEE80211_S_RUN && sc->rxon->associd != 0)
+		iwn_bgscan_setup(sc, hdr, ni);
+
 	tx = (struct iwn_cmd_data *)(hdr + 1);
 	tx->flags = htole32(IWN_TX_AUTO_SEQ);
 	if(ivp->ctx == IWN_RXON_PAN_CTX)
@@ -5699,7 +8026,7 @@ iwn_auth(struct iwn_softc *sc, struct ieee80211vap *vap)
 	struct ifnet *ifp = sc->sc_ifp;
 	struct ieee80211com *ic = ifp->if_l2com;
 	struct ieee80211_node *ni = vap->iv_bss;
-	int error;
+	int error, full;
 
 	DPRINTF(sc, IWN_DEBUG_TRACE, "->%s begin\n", __func__);
 
@@ -5728,12 +8055,17 @@ iwn_auth(struct iwn_softc *sc, struct ieee80211vap *vap)
 	DPRINTF(sc, IWN_DEBUG_STATE, "rxon chan %d flags %x cck %x ofdm %x\n",
 	    sc->rxon->chan, sc->rxon->flags, sc->rxon->cck_mask,
 	    sc->rxon->ofdm_mask);
-	error = iwn_cmd(sc, IWN_CMD_RXON, sc->rxon, sc->rxonsz, 1);
+	error = iwn_rxon_commit(sc, IWN_RXON_BSS_CTX, 1, &full);
 	if (error != 0) {
 		device_printf(sc->sc_dev, "%s: RXON command failed, error %d\n",
 		    __func__, error);
 		return error;
 	}
+	if (!full) {
+		/* Node table and TX power are still valid. */
+		DPRINTF(sc, IWN_DEBUG_TRACE, "->%s: end\n", __func__);
+		return 0;
+	}
 
 	/* Configuration has changed, set TX power accordingly. */
 	if ((error = ops->set_txpower(sc, ni->ni_chan, 1)) != 0) {
@@ -5766,7 +8098,7 @@ iwn_run(struct iwn_softc *sc, struct ieee80211vap *vap)
 	struct ieee80211_node *ni = vap->iv_bss;
 	struct iwn_node_info node;
 	uint32_t htflags = 0;
-	int error;
+	int error, full;
 
 	DPRINTF(sc, IWN_DEBUG_TRACE, "->%s begin\n", __func__);
 
@@ -5833,7 +8165,7 @@ iwn_run(struct iwn_softc *sc, struct ieee80211vap *vap)
 	sc->rxon->filter |= htole32(IWN_FILTER_BSS);
 	DPRINTF(sc, IWN_DEBUG_STATE, "rxon chan %d flags %x\n",
 	    sc->rxon->chan, sc->rxon->flags);
-	error = iwn_cmd(sc, IWN_CMD_RXON, sc->rxon, sc->rxonsz, 1);
+	error = iwn_rxon_commit(sc, IWN_RXON_BSS_CTX, 1, &full);
 	if (error != 0) {
 		device_printf(sc->sc_dev,
 		    "%s: could not update configuration, error %d\n", __func__,
@@ -5842,7 +8174,7 @@ iwn_run(struct iwn_softc *sc, struct ieee80211vap *vap)
 	}
 
 	/* Configuration has changed, set TX power accordingly. */
-	if ((error = ops->set_txpower(sc, ni->ni_chan, 1)) != 0) {
+	if (full && (error = ops->set_txpower(sc, ni->ni_chan, 1)) != 0) {
 		device_printf(sc->sc_dev,
 		    "%s: could not set TX power, error %d\n", __func__, error);
 		return error;
@@ -5987,29 +8319,51 @@ iwn_addba_request(struct ieee80211_node *ni, struct ieee80211_tx_ampdu *tap,
     int dialogtoken, int baparamset, int batimeout)
 {
 	struct iwn_softc *sc = ni->ni_ic->ic_ifp->if_softc;
-	int qid;
+	int error, qid;
 
 	DPRINTF(sc, IWN_DEBUG_TRACE, "->Doing %s\n", __func__);
 
+	if (sc->base_params->adv_thermal_throttle &&
+	    iwn_tt_restrict[sc->tt_state].noagg) {
+		DPRINTF(sc, IWN_DEBUG_XMIT, "%s: refused, too hot\n", __func__);
+		return 0;
+	}
+
+	/* Reserve the queue first; this also keeps it from being freed. */
+	IWN_TX_LOCK(sc);
 	for (qid = sc->firstaggqueue; qid < sc->ntxqs; qid++) {
-		if (sc->qid2tap[qid] == NULL)
+		if (sc->qid2tap[qid] == NULL &&
+		    !(sc->txq_freeing & (1 << qid)))
 			break;
 	}
 	if (qid == sc->ntxqs) {
+		IWN_TX_UNLOCK(sc);
 		DPRINTF(sc, IWN_DEBUG_XMIT, "%s: not free aggregation queue\n",
 		    __func__);
 		return 0;
 	}
-	tap->txa_private = malloc(sizeof(int), M_DEVBUF, M_NOWAIT);
-	if (tap->txa_private == NULL) {
-		device_printf(sc->sc_dev,
-		    "%s: failed to alloc TX aggregation structure\n", __func__);
-		return 0;
-	}
 	sc->qid2tap[qid] = tap;
-	*(int *)tap->txa_private = qid;
+	IWN_TX_UNLOCK(sc);
+
+	if (sc->txq[qid].desc == NULL) {
+		error = iwn_alloc_tx_ring(sc, &sc->txq[qid], qid);
+		if (error != 0) {
+			device_printf(sc->sc_dev,
+			    "%s: could not allocate TX ring %d, error %d\n",
+			    __func__, qid, error);
+			goto fail;
+		}
+		sc->txq_allocs++;
+	}
+	/* Transmitters find the ring through this; no allocation needed. */
+	tap->txa_private = &sc->txq[qid].qid;
 	return sc->sc_addba_request(ni, tap, dialogtoken, baparamset,
 	    batimeout);
+
+fail:	IWN_TX_LOCK(sc);
+	sc->qid2tap[qid] = NULL;
+	IWN_TX_UNLOCK(sc);
+	return 0;
 }
 
 static int
@@ -6029,9 +8383,10 @@ iwn_addba_response(struct ieee80211_node *ni, struct ieee80211_tx_ampdu *tap,
 		if (ret != 1)
 			return ret;
 	} else {
+		IWN_TX_LOCK(sc);
 		sc->qid2tap[qid] = NULL;
-		free(tap->txa_private, M_DEVBUF);
 		tap->txa_private = NULL;
+		IWN_TX_UNLOCK(sc);
 	}
 	return sc->sc_addba_response(ni, tap, code, baparamset, batimeout);
 }
@@ -6053,6 +8408,7 @@ iwn_ampdu_tx_start(struct ieee80211com *ic, struct ieee80211_node *ni,
 
 	DPRINTF(sc, IWN_DEBUG_TRACE, "->Doing %s\n", __func__);
 
+	IWN_LOCK(sc);
 	/* Enable TX for the specified RA/TID. */
 	wn->disable_tid &= ~(1 << tid);
 	memset(&node, 0, sizeof node);
@@ -6061,18 +8417,25 @@ iwn_ampdu_tx_start(struct ieee80211com *ic, struct ieee80211_node *ni,
 	node.flags = IWN_FLAG_SET_DISABLE_TID;
 	node.disable_tid = htole16(wn->disable_tid);
 	error = ops->add_node(sc, &node, 1);
-	if (error != 0)
+	if (error != 0) {
+		IWN_UNLOCK(sc);
 		return 0;
+	}
 
-	if ((error = iwn_nic_lock(sc)) != 0)
+	if ((error = iwn_nic_lock(sc)) != 0) {
+		IWN_UNLOCK(sc);
 		return 0;
+	}
 	qid = *(int *)tap->txa_private;
 	DPRINTF(sc, IWN_DEBUG_XMIT, "%s: ra=%d tid=%d ssn=%d qid=%d\n",
 	    __func__, wn->id, tid, tap->txa_start, qid);
+	/* The ring may have been allocated after iwn_hw_init(). */
+	IWN_WRITE(sc, IWN_FH_CBBC_QUEUE(qid), sc->txq[qid].desc_dma.paddr >> 8);
 	ops->ampdu_tx_start(sc, ni, qid, tid, tap->txa_start & 0xfff);
 	iwn_nic_unlock(sc);
 
 	iwn_set_link_quality(sc, ni);
+	IWN_UNLOCK(sc);
 	return 1;
 }
 
@@ -6082,7 +8445,7 @@ iwn_ampdu_tx_stop(struct ieee80211_node *ni, struct ieee80211_tx_ampdu *tap)
 	struct iwn_softc *sc = ni->ni_ic->ic_ifp->if_softc;
 	struct iwn_ops *ops = &sc->ops;
 	uint8_t tid = tap->txa_tid;
-	int qid;
+	int locked, qid;
 
 	DPRINTF(sc, IWN_DEBUG_TRACE, "->Doing %s\n", __func__);
 
@@ -6094,13 +8457,22 @@ iwn_ampdu_tx_stop(struct ieee80211_node *ni, struct ieee80211_tx_ampdu *tap)
 	qid = *(int *)tap->txa_private;
 	if (sc->txq[qid].queued != 0)
 		return;
-	if (iwn_nic_lock(sc) != 0)
-		return;
-	ops->ampdu_tx_stop(sc, qid, tid, tap->txa_start & 0xfff);
-	iwn_nic_unlock(sc);
-	sc->qid2tap[qid] = NULL;
-	free(tap->txa_private, M_DEVBUF);
-	tap->txa_private = NULL;
+	/*
+	 * Also reached through ieee80211_free_node() when our completion
+	 * paths drop the last reference to a node, with the lock held.
+	 */
+	if (!(locked = mtx_owned(&sc->sc_mtx)))
+		IWN_LOCK(sc);
+	if (iwn_nic_lock(sc) == 0) {
+		ops->ampdu_tx_stop(sc, qid, tid, tap->txa_start & 0xfff);
+		iwn_nic_unlock(sc);
+		IWN_TX_LOCK(sc);
+		sc->qid2tap[qid] = NULL;
+		tap->txa_private = NULL;
+		IWN_TX_UNLOCK(sc);
+	}
+	if (!locked)
+		IWN_UNLOCK(sc);
 }
 
 static void
@@ -6126,8 +8498,10 @@ iwn5000_ampdu_tx_start(struct iwn_softc *sc, struct ieee80211_node *ni,
 	iwn_prph_setbits(sc, IWN5000_SCHED_AGGR_SEL, 1 << qid);
 
 	/* Set starting sequence number from the ADDBA request. */
+	IWN_TXQ_LOCK(&sc->txq[qid]);
 	sc->txq[qid].cur = sc->txq[qid].read = (ssn & 0xff);
 	IWN_WRITE(sc, IWN_HBUS_TARG_WRPTR, qid << 8 | (ssn & 0xff));
+	IWN_TXQ_UNLOCK(&sc->txq[qid]);
 	iwn_prph_write(sc, IWN5000_SCHED_QUEUE_RDPTR(qid), ssn);
 
 	/* Set scheduler window size and frame limit. */
@@ -6226,6 +8600,59 @@ iwn5000_send_calibration(struct iwn_softc *sc)
 	return 0;
 }
 
+/*
+ * Discard saved calibration results and force the INIT firmware to run
+ * on next init.
+ */
+static void
+iwn_calib_flush(struct iwn_softc *sc)
+{
+	int idx;
+
+	for (idx = 0; idx < IWN5000_PHY_CALIB_MAX_RESULT; idx++) {
+		if (sc->calibcmd[idx].buf != NULL)
+			free(sc->calibcmd[idx].buf, M_DEVBUF);
+		sc->calibcmd[idx].buf = NULL;
+		sc->calibcmd[idx].len = 0;
+	}
+	sc->sc_flags &= ~IWN_FLAG_CALIB_DONE;
+}
+
+/*
+ * Decide whether the saved calibration results can be sent to the runtime
+ * firmware directly.  They must come from the same firmware version, be
+ * younger than IWN_CALIB_CACHE_MAXAGE and, if the temperature is known on
+ * both sides, from the same temperature band.
+ */
+static void
+iwn_calib_cache_check(struct iwn_softc *sc)
+{
+	const char *why = NULL;
+
+	if (!(sc->sc_flags & IWN_FLAG_CALIB_DONE))
+		return;
+
+	if (sc->calib_fwver != sc->fw_ver)
+		why = "firmware version changed";
+	else if (time_uptime - sc->calib_stamp > IWN_CALIB_CACHE_MAXAGE)
+		why = "too old";
+	else if (sc->calib_tband != IWN_CALIB_TBAND_UNKNOWN &&
+	    sc->rawtemp != 0 &&
+	    sc->curtemp / IWN_CALIB_TBAND_WIDTH != sc->calib_tband)
+		why = "temperature band changed";
+
+	if (why != NULL) {
+		DPRINTF(sc, IWN_DEBUG_CALIBRATE,
+		    "%s: discarding calibration results: %s\n", __func__, why);
+		sc->calib_stale++;
+		iwn_calib_flush(sc);
+		return;
+	}
+	DPRINTF(sc, IWN_DEBUG_CALIBRATE, "%s: reusing calibration results\n",
+	    __func__);
+	sc->calib_reused++;
+}
+
 static int
 iwn5000_send_wimax_coex(struct iwn_softc *sc)
 {
@@ -6320,6 +8747,7 @@ iwn5000_temp_offset_calibv2(struct iwn_softc *sc)
 static int
 iwn5000_post_alive(struct iwn_softc *sc)
 {
+	uint32_t qctx[2 * IWN5000_NTXQUEUES];
 	int error, qid;
 
 	DPRINTF(sc, IWN_DEBUG_TRACE, "->%s begin\n", __func__);
@@ -6354,13 +8782,13 @@ iwn5000_post_alive(struct iwn_softc *sc)
 		iwn_prph_write(sc, IWN5000_SCHED_QUEUE_RDPTR(qid), 0);
 		IWN_WRITE(sc, IWN_HBUS_TARG_WRPTR, qid << 8 | 0);
 
-		iwn_mem_write(sc, sc->sched_base +
-		    IWN5000_SCHED_QUEUE_OFFSET(qid), 0);
+		qctx[qid * 2] = 0;
 		/* Set scheduler window size and frame limit. */
-		iwn_mem_write(sc, sc->sched_base +
-		    IWN5000_SCHED_QUEUE_OFFSET(qid) + 4,
-		    IWN_SCHED_LIMIT << 16 | IWN_SCHED_WINSZ);
+		qctx[qid * 2 + 1] = IWN_SCHED_LIMIT << 16 | IWN_SCHED_WINSZ;
 	}
+	/* Queue contexts are contiguous, write them in one burst. */
+	iwn_mem_write_region_4(sc, sc->sched_base +
+	    IWN5000_SCHED_QUEUE_OFFSET(0), qctx, nitems(qctx));
 
 	/* Enable interrupts for all our 20 queues. */
 	iwn_prph_write(sc, IWN5000_SCHED_INTR_MASK, 0xfffff);
@@ -6416,22 +8844,15 @@ iwn5000_post_alive(struct iwn_softc *sc)
 }
 
 /*
- * The firmware boot code is small and is intended to be copied directly into
- * the NIC internal memory (no DMA transfer).
+ * Start an FH service channel transfer of ``size'' bytes from host memory
+ * at ``paddr'' to device SRAM at ``dst''.
  */
 static int
-iwn5000_load_firmware_section(struct iwn_softc *sc, uint32_t dst,
-    const uint8_t *section, int size)
+iwn5000_fw_dma_kick(struct iwn_softc *sc, uint32_t dst, bus_addr_t paddr,
+    int size)
 {
-	struct iwn_dma_info *dma = &sc->fw_dma;
 	int error;
 
-	DPRINTF(sc, IWN_DEBUG_TRACE, "->Doing %s\n", __func__);
-
-	/* Copy firmware section into pre-allocated DMA-safe memory. */
-	memcpy(dma->vaddr, section, size);
-	bus_dmamap_sync(dma->tag, dma->map, BUS_DMASYNC_PREWRITE);
-
 	if ((error = iwn_nic_lock(sc)) != 0)
 		return error;
 
@@ -6440,22 +8861,74 @@ iwn5000_load_firmware_section(struct iwn_softc *sc, uint32_t dst,
 
 	IWN_WRITE(sc, IWN_FH_SRAM_ADDR(IWN_SRVC_DMACHNL), dst);
 	IWN_WRITE(sc, IWN_FH_TFBD_CTRL0(IWN_SRVC_DMACHNL),
-	    IWN_LOADDR(dma->paddr));
+	    IWN_LOADDR(paddr));
 	IWN_WRITE(sc, IWN_FH_TFBD_CTRL1(IWN_SRVC_DMACHNL),
-	    IWN_HIADDR(dma->paddr) << 28 | size);
+	    IWN_HIADDR(paddr) << 28 | size);
 	IWN_WRITE(sc, IWN_FH_TXBUF_STATUS(IWN_SRVC_DMACHNL),
 	    IWN_FH_TXBUF_STATUS_TBNUM(1) |
 	    IWN_FH_TXBUF_STATUS_TBIDX(1) |
 	    IWN_FH_TXBUF_STATUS_TFBD_VALID);
 
 	/* Kick Flow Handler to start DMA transfer. */
+	sc->fw_dma_done = 0;
 	IWN_WRITE(sc, IWN_FH_TX_CONFIG(IWN_SRVC_DMACHNL),
 	    IWN_FH_TX_CONFIG_DMA_ENA | IWN_FH_TX_CONFIG_CIRQ_HOST_ENDTFD);
 
 	iwn_nic_unlock(sc);
+	return 0;
+}
+
+/*
+ * Wait for the FH_TX interrupt signalling the end of the current transfer.
+ */
+static int
+iwn5000_fw_dma_wait(struct iwn_softc *sc)
+{
+	int error;
+
+	while (!sc->fw_dma_done) {
+		/* Wait at most one second per chunk. */
+		error = msleep(&sc->fw_dma_done, &sc->sc_mtx, PCATCH,
+		    "iwnfwdma", hz);
+		if (error != 0)
+			return error;
+	}
+	return 0;
+}
+
+/*
+ * Upload a firmware section to the NIC internal memory.  The section is
+ * split in IWN5000_FW_CHUNKSZ chunks alternating between the two halves
+ * of fw_dma: the next chunk is copied while the previous one is being
+ * transferred by the flow handler.
+ */
+static int
+iwn5000_load_firmware_section(struct iwn_softc *sc, uint32_t dst,
+    const uint8_t *section, int size)
+{
+	struct iwn_dma_info *dma = &sc->fw_dma;
+	int error, off, len, buf = 0, pending = 0;
+
+	DPRINTF(sc, IWN_DEBUG_TRACE, "->Doing %s\n", __func__);
+
+	for (off = 0; off < size; off += len) {
+		len = MIN(size - off, IWN5000_FW_CHUNKSZ);
 
-	/* Wait at most five seconds for FH DMA transfer to complete. */
-	return msleep(sc, &sc->sc_mtx, PCATCH, "iwninit", 5 * hz);
+		/* Copy chunk into pre-allocated DMA-safe memory. */
+		memcpy(dma->vaddr + buf * IWN5000_FW_CHUNKSZ, section + off,
+		    len);
+		bus_dmamap_sync(dma->tag, dma->map, BUS_DMASYNC_PREWRITE);
+
+		if (pending && (error = iwn5000_fw_dma_wait(sc)) != 0)
+			return error;
+		error = iwn5000_fw_dma_kick(sc, dst + off,
+		    dma->paddr + buf * IWN5000_FW_CHUNKSZ, len);
+		if (error != 0)
+			return error;
+		pending = 1;
+		buf ^= 1;
+	}
+	return pending ? iwn5000_fw_dma_wait(sc) : 0;
 }
 
 static int
@@ -6504,6 +8977,7 @@ iwn_read_firmware_leg(struct iwn_softc *sc, struct iwn_fw_info *fw)
 
 	ptr = (const uint32_t *)fw->data;
 	rev = le32toh(*ptr++);
+	sc->fw_ver = rev;
 
 	/* Check firmware API version. */
 	if (IWN_FW_API(rev) <= 1) {
@@ -6570,6 +9044,7 @@ iwn_read_firmware_tlv(struct iwn_softc *sc, struct iwn_fw_info *fw,
 	}
 	DPRINTF(sc, IWN_DEBUG_RESET, "FW: \"%.64s\", build 0x%x\n", hdr->descr,
 	    le32toh(hdr->build));
+	sc->fw_ver = le32toh(hdr->rev);
 
 	/*
 	 * Select the closest supported alternative that is less than
@@ -6582,6 +9057,7 @@ iwn_read_firmware_tlv(struct iwn_softc *sc, struct iwn_fw_info *fw,
 
 	ptr = (const uint8_t *)(hdr + 1);
 	end = (const uint8_t *)(fw->data + fw->size);
+	sc->sc_flags &= ~IWN_FLAG_PHY_CALIB_TLV;
 
 	/* Parse type-length-value fields. */
 	while (ptr + sizeof (*tlv) <= end) {
@@ -6629,6 +9105,7 @@ iwn_read_firmware_tlv(struct iwn_softc *sc, struct iwn_fw_info *fw,
 			if (tmp < 253) {
 				sc->reset_noise_gain = tmp;
 				sc->noise_gain = tmp + 1;
+				sc->sc_flags |= IWN_FLAG_PHY_CALIB_TLV;
 			}
 			break;
 		case IWN_FW_TLV_PAN:
@@ -6639,9 +9116,13 @@ iwn_read_firmware_tlv(struct iwn_softc *sc, struct iwn_fw_info *fw,
 		case IWN_FW_TLV_FLAGS :
 			sc->tlv_feature_flags = htole32(*ptr);
 			break;
-		case IWN_FW_TLV_PBREQ_MAXLEN:
 		case IWN_FW_TLV_RUNT_EVTLOG_PTR:
+			sc->evtlog_fwptr = le32toh(*ptr);
+			break;
 		case IWN_FW_TLV_RUNT_EVTLOG_SIZE:
+			sc->evtlog_fwsize = le32toh(*ptr);
+			break;
+		case IWN_FW_TLV_PBREQ_MAXLEN:
 		case IWN_FW_TLV_RUNT_ERRLOG_PTR:
 		case IWN_FW_TLV_INIT_EVTLOG_PTR:
 		case IWN_FW_TLV_INIT_EVTLOG_SIZE:
@@ -6667,32 +9148,45 @@ static int
 iwn_read_firmware(struct iwn_softc *sc)
 {
 	struct iwn_fw_info *fw = &sc->fw;
+	const struct firmware *fp;
 	int error;
 
 	DPRINTF(sc, IWN_DEBUG_TRACE, "->Doing %s\n", __func__);
 
-	IWN_UNLOCK(sc);
-
-	memset(fw, 0, sizeof (*fw));
+	/*
+	 * The parsed image is kept across resets and resumes; sc->fw still
+	 * points into it.  sc->fw_fp is only set once sc->fw is valid.
+	 */
+	if (sc->fw_fp != NULL) {
+		sc->fw_cache_hits++;
+		return 0;
+	}
 
 	/* Read firmware image from filesystem. */
-	sc->fw_fp = firmware_get(sc->fwname);
-	if (sc->fw_fp == NULL) {
+	IWN_UNLOCK(sc);
+	fp = firmware_get(sc->fwname);
+	IWN_LOCK(sc);
+	if (fp == NULL) {
 		device_printf(sc->sc_dev, "%s: could not read firmware %s\n",
 		    __func__, sc->fwname);
-		IWN_LOCK(sc);
 		return EINVAL;
 	}
-	IWN_LOCK(sc);
+	if (sc->fw_fp != NULL) {
+		/* Loaded by another thread while we slept. */
+		firmware_put(fp, FIRMWARE_UNLOAD);
+		sc->fw_cache_hits++;
+		return 0;
+	}
+	sc->fw_loads++;
 
-	fw->size = sc->fw_fp->datasize;
-	fw->data = (const uint8_t *)sc->fw_fp->data;
+	memset(fw, 0, sizeof (*fw));
+	fw->size = fp->datasize;
+	fw->data = (const uint8_t *)fp->data;
 	if (fw->size < sizeof (uint32_t)) {
 		device_printf(sc->sc_dev, "%s: firmware too short: %zu bytes\n",
 		    __func__, fw->size);
-		firmware_put(sc->fw_fp, FIRMWARE_UNLOAD);
-		sc->fw_fp = NULL;
-		return EINVAL;
+		error = EINVAL;
+		goto fail;
 	}
 
 	/* Retrieve text and data sections. */
@@ -6704,9 +9198,7 @@ iwn_read_firmware(struct iwn_softc *sc)
 		device_printf(sc->sc_dev,
 		    "%s: could not read firmware sections, error %d\n",
 		    __func__, error);
-		firmware_put(sc->fw_fp, FIRMWARE_UNLOAD);
-		sc->fw_fp = NULL;
-		return error;
+		goto fail;
 	}
 
 	/* Make sure text and data sections fit in hardware memory. */
@@ -6718,13 +9210,30 @@ iwn_read_firmware(struct iwn_softc *sc)
 	    (fw->boot.textsz & 3) != 0) {
 		device_printf(sc->sc_dev, "%s: firmware sections too large\n",
 		    __func__);
-		firmware_put(sc->fw_fp, FIRMWARE_UNLOAD);
-		sc->fw_fp = NULL;
-		return EINVAL;
+		error = EINVAL;
+		goto fail;
 	}
 
 	/* We can proceed with loading the firmware. */
+	sc->fw_fp = fp;
 	return 0;
+
+fail:	firmware_put(fp, FIRMWARE_UNLOAD);
+	memset(fw, 0, sizeof (*fw));
+	return error;
+}
+
+/*
+ * Drop the cached firmware image.
+ */
+static void
+iwn_release_firmware(struct iwn_softc *sc)
+{
+	if (sc->fw_fp == NULL)
+		return;
+	firmware_put(sc->fw_fp, FIRMWARE_UNLOAD);
+	sc->fw_fp = NULL;
+	memset(&sc->fw, 0, sizeof (sc->fw));
 }
 
 static int
@@ -6931,7 +9440,7 @@ static int
 iwn_hw_init(struct iwn_softc *sc)
 {
 	struct iwn_ops *ops = &sc->ops;
-	int error, chnl, qid;
+	int error, chnl, qid, opath;
 
 	DPRINTF(sc, IWN_DEBUG_TRACE, "->%s begin\n", __func__);
 
@@ -6972,12 +9481,8 @@ iwn_hw_init(struct iwn_softc *sc)
 	    IWN_FH_RX_CONFIG_SINGLE_FRAME  |
 	    IWN_FH_RX_CONFIG_RB_TIMEOUT(0) |
 	    IWN_FH_RX_CONFIG_NRBD(IWN_RX_RING_COUNT_LOG));
-	iwn_nic_unlock(sc);
 	IWN_WRITE(sc, IWN_FH_RX_WPTR, (IWN_RX_RING_COUNT - 1) & ~7);
 
-	if ((error = iwn_nic_lock(sc)) != 0)
-		return error;
-
 	/* Initialize TX scheduler. */
 	iwn_prph_write(sc, sc->sched_txfact_addr, 0);
 
@@ -6990,7 +9495,7 @@ iwn_hw_init(struct iwn_softc *sc)
 
 		/* Set physical address of TX ring (256-byte aligned). */
 		IWN_WRITE(sc, IWN_FH_CBBC_QUEUE(qid),
-		    txq->desc_dma.paddr >> 8);
+		    (txq->desc != NULL) ? txq->desc_dma.paddr >> 8 : 0);
 	}
 	iwn_nic_unlock(sc);
 
@@ -7037,7 +9542,10 @@ iwn_hw_init(struct iwn_softc *sc)
 
 	DPRINTF(sc, IWN_DEBUG_TRACE, "->%s: end\n",__func__);
 
-	return ops->post_alive(sc);
+	opath = iwn_regpath_enter(sc, IWN_REGPATH_POST_ALIVE);
+	error = ops->post_alive(sc);
+	iwn_regpath_leave(sc, opath);
+	return error;
 }
 
 static void
@@ -7055,7 +9563,16 @@ iwn_hw_stop(struct iwn_softc *sc)
 	IWN_WRITE(sc, IWN_FH_INT, 0xffffffff);
 	sc->sc_flags &= ~IWN_FLAG_USE_ICT;
 
+	/* The firmware forgets its RXON; force a full one next time. */
+	sc->rxon_valid = 0;
+	/* The firmware starts counting from zero again. */
+	memset(sc->fwstats_last, 0, sizeof sc->fwstats_last);
+	sc->fwstats_clear_pending = 0;
+	sc->fwstats_reqs = sc->fwstats_replies = 0;
+
 	/* Make sure we no longer hold the NIC lock. */
+	sc->nic_ref = 0;
+	sc->nic_batch = 0;
 	iwn_nic_unlock(sc);
 
 	/* Stop TX scheduler. */
@@ -7135,19 +9652,22 @@ iwn_radio_off(void *arg0, int pending)
 	IWN_UNLOCK(sc);
 }
 
-static void
-iwn_init_locked(struct iwn_softc *sc)
+/*
+ * Power up the adapter, boot the runtime firmware and push the initial
+ * configuration.  Returns EAGAIN if the radio is switched off, in which
+ * case only the RF toggle interrupt is left enabled.
+ */
+static int
+iwn_bringup(struct iwn_softc *sc)
 {
-	struct ifnet *ifp = sc->sc_ifp;
-	int error;
+	int error, opath;
 
-	DPRINTF(sc, IWN_DEBUG_TRACE, "->%s begin\n", __func__);
 	IWN_LOCK_ASSERT(sc);
 
 	if ((error = iwn_hw_prepare(sc)) != 0) {
 		device_printf(sc->sc_dev, "%s: hardware not ready, error %d\n",
 		    __func__, error);
-		goto fail;
+		return error;
 	}
 
 	/* Initialize interrupt mask to default value. */
@@ -7161,7 +9681,7 @@ iwn_init_locked(struct iwn_softc *sc)
 		/* Enable interrupts to get RF toggle notifications. */
 		IWN_WRITE(sc, IWN_INT, 0xffffffff);
 		IWN_WRITE(sc, IWN_INT_MASK, sc->int_mask);
-		return;
+		return EAGAIN;
 	}
 
 	/* Read firmware images from the filesystem. */
@@ -7169,18 +9689,26 @@ iwn_init_locked(struct iwn_softc *sc)
 		device_printf(sc->sc_dev,
 		    "%s: could not read firmware, error %d\n", __func__,
 		    error);
-		goto fail;
+		return error;
 	}
 
-	/* Initialize hardware and upload firmware. */
+	/* Skip the INIT firmware if the last calibration is still fresh. */
+	iwn_calib_cache_check(sc);
+
+	/*
+	 * Initialize hardware and upload firmware.  The image stays cached
+	 * until detach or until released through sysctl.
+	 */
+	sc->sc_flags |= IWN_FLAG_FW_LOADING;
+	opath = iwn_regpath_enter(sc, IWN_REGPATH_INIT);
 	error = iwn_hw_init(sc);
-	firmware_put(sc->fw_fp, FIRMWARE_UNLOAD);
-	sc->fw_fp = NULL;
+	iwn_regpath_leave(sc, opath);
+	sc->sc_flags &= ~IWN_FLAG_FW_LOADING;
 	if (error != 0) {
 		device_printf(sc->sc_dev,
 		    "%s: could not initialize hardware, error %d\n", __func__,
 		    error);
-		goto fail;
+		return error;
 	}
 
 	/* Configure adapter now that it is ready. */
@@ -7188,11 +9716,29 @@ iwn_init_locked(struct iwn_softc *sc)
 		device_printf(sc->sc_dev,
 		    "%s: could not configure device, error %d\n", __func__,
 		    error);
-		goto fail;
+		return error;
 	}
+	return 0;
+}
+
+static void
+iwn_init_locked(struct iwn_softc *sc)
+{
+	struct ifnet *ifp = sc->sc_ifp;
+	int error;
+
+	DPRINTF(sc, IWN_DEBUG_TRACE, "->%s begin\n", __func__);
+	IWN_LOCK_ASSERT(sc);
+
+	if ((error = iwn_bringup(sc)) == EAGAIN)
+		return;
+	if (error != 0)
+		goto fail;
 
+	IWN_TX_LOCK(sc);
 	ifp->if_drv_flags &= ~IFF_DRV_OACTIVE;
 	ifp->if_drv_flags |= IFF_DRV_RUNNING;
+	IWN_TX_UNLOCK(sc);
 
 	callout_reset(&sc->watchdog_to, hz, iwn_watchdog, sc);
 
@@ -7224,6 +9770,7 @@ static void
 iwn_stop_locked(struct iwn_softc *sc)
 {
 	struct ifnet *ifp = sc->sc_ifp;
+	int opath;
 
 	IWN_LOCK_ASSERT(sc);
 
@@ -7231,10 +9778,17 @@ iwn_stop_locked(struct iwn_softc *sc)
 	sc->sc_scan_timer = 0;
 	callout_stop(&sc->watchdog_to);
 	callout_stop(&sc->calib_to);
+	callout_stop(&sc->ct_kill_exit_to);
+	sc->tt_state = IWN_TT_NORMAL;
+	/* Wait for in-flight transmits; new ones see !RUNNING and bail. */
+	IWN_TX_LOCK(sc);
 	ifp->if_drv_flags &= ~(IFF_DRV_RUNNING | IFF_DRV_OACTIVE);
+	IWN_TX_UNLOCK(sc);
 
 	/* Power OFF hardware. */
+	opath = iwn_regpath_enter(sc, IWN_REGPATH_STOP);
 	iwn_hw_stop(sc);
+	iwn_regpath_leave(sc, opath);
 }
 
 static void
@@ -7344,7 +9898,18 @@ iwn_scan_curchan(struct ieee80211_scan_state *ss, unsigned long maxdwell)
 
 	IWN_LOCK(sc);
 	sc->sc_scan_timer = 0;
-	error = iwn_scan(sc);
+	/*
+	 * Don't go off channel while the data rings are backed up; cancel
+	 * the background scan and let net80211 retry it after the next
+	 * bgscan interval.
+	 */
+	if (vap->iv_state == IEEE80211_S_RUN && iwn_bgscan_busy(sc)) {
+		sc->bgscan_deferred++;
+		DPRINTF(sc, IWN_DEBUG_STATE,
+		    "%s: deferring background scan, TX busy\n", __func__);
+		error = EBUSY;
+	} else
+		error = iwn_scan(sc);
 	IWN_UNLOCK(sc);
 	if (error != 0) {
 		sc->uc_scan_progress = 0;
@@ -7377,6 +9942,132 @@ iwn_hw_reset(void *arg0, int pending)
 	iwn_init(sc);
 	ieee80211_notify_radio(ic, 1);
 }
+
+/*
+ * Re-establish the block ack sessions of a node after a firmware
+ * restart.  The rings were emptied by iwn_hw_stop(), so aggregation
+ * queues restart at the next sequence number net80211 will hand out.
+ */
+static void
+iwn_restart_ampdu(struct iwn_softc *sc, struct ieee80211_node *ni)
+{
+	struct iwn_ops *ops = &sc->ops;
+	struct iwn_node *wn = (void *)ni;
+	struct ieee80211_tx_ampdu *tap;
+	struct iwn_node_info node;
+	int qid, tid;
+
+	for (tid = 0; tid < WME_NUM_TID; tid++) {
+		struct ieee80211_rx_ampdu *rap = &ni->ni_rx_ampdu[tid];
+
+		if (!(rap->rxa_flags & IEEE80211_AGGR_RUNNING))
+			continue;
+		memset(&node, 0, sizeof node);
+		node.id = wn->id;
+		node.control = IWN_NODE_UPDATE;
+		node.flags = IWN_FLAG_SET_ADDBA;
+		node.addba_tid = tid;
+		node.addba_ssn = htole16(rap->rxa_start);
+		(void)ops->add_node(sc, &node, 1);
+	}
+
+	memset(&node, 0, sizeof node);
+	node.id = wn->id;
+	node.control = IWN_NODE_UPDATE;
+	node.flags = IWN_FLAG_SET_DISABLE_TID;
+	node.disable_tid = htole16(wn->disable_tid);
+	if (ops->add_node(sc, &node, 1) != 0)
+		return;
+
+	if (iwn_nic_lock(sc) != 0)
+		return;
+	for (qid = sc->firstaggqueue; qid < sc->ntxqs; qid++) {
+		tap = sc->qid2tap[qid];
+		if (tap == NULL || tap->txa_ni != ni ||
+		    !IEEE80211_AMPDU_RUNNING(tap))
+			continue;
+		tid = tap->txa_tid;
+		DPRINTF(sc, IWN_DEBUG_RESET, "%s: qid=%d tid=%d ssn=%d\n",
+		    __func__, qid, tid, ni->ni_txseqs[tid]);
+		IWN_WRITE(sc, IWN_FH_CBBC_QUEUE(qid),
+		    sc->txq[qid].desc_dma.paddr >> 8);
+		ops->ampdu_tx_start(sc, ni, qid, tid, ni->ni_txseqs[tid]);
+	}
+	iwn_nic_unlock(sc);
+}
+
+/*
+ * Recover from a firmware error without involving net80211: reboot the
+ * runtime firmware from the cached image and calibration results, then
+ * push back the association state it lost.  Frames still on if_snd are
+ * sent once we are done; those already handed to the firmware are lost.
+ * Anything going wrong falls back to a full reset, as do modes other
+ * than station and monitor: we only know how to re-add the BSS node,
+ * not the peers of an IBSS or the stations of a hostap vap.
+ */
+static void
+iwn_fw_restart(void *arg0, int pending)
+{
+	struct iwn_softc *sc = arg0;
+	struct ifnet *ifp = sc->sc_ifp;
+	struct ieee80211com *ic = ifp->if_l2com;
+	struct ieee80211vap *vap;
+	int error, start;
+
+	DPRINTF(sc, IWN_DEBUG_TRACE | IWN_DEBUG_RESET, "->Doing %s\n",
+	    __func__);
+
+	start = ticks;
+	IWN_LOCK(sc);
+	if (!(ifp->if_drv_flags & IFF_DRV_RUNNING)) {
+		IWN_UNLOCK(sc);
+		return;
+	}
+	if (ic->ic_opmode != IEEE80211_M_STA &&
+	    ic->ic_opmode != IEEE80211_M_MONITOR) {
+		IWN_UNLOCK(sc);
+		iwn_hw_reset(sc, 0);
+		return;
+	}
+	/* Keeps producers out until the firmware knows our peers again. */
+	iwn_stop_locked(sc);
+
+	error = iwn_bringup(sc);
+	TAILQ_FOREACH(vap, &ic->ic_vaps, iv_next) {
+		if (error != 0)
+			break;
+		if (vap->iv_state != IEEE80211_S_RUN)
+			continue;
+		if (IWN_VAP(vap)->ctx == IWN_RXON_PAN_CTX)
+			error = iwn_run_u1(sc, vap);
+		else
+			error = iwn_run(sc, vap);
+		if (error == 0 && ic->ic_opmode != IEEE80211_M_MONITOR)
+			iwn_restart_ampdu(sc, vap->iv_bss);
+	}
+	if (error != 0) {
+		sc->fw_restart_fails++;
+		IWN_UNLOCK(sc);
+		device_printf(sc->sc_dev,
+		    "%s: restart failed, error %d; resetting\n", __func__,
+		    error);
+		iwn_hw_reset(sc, 0);
+		return;
+	}
+
+	IWN_TX_LOCK(sc);
+	ifp->if_drv_flags |= IFF_DRV_RUNNING;
+	IWN_TX_UNLOCK(sc);
+	callout_reset(&sc->watchdog_to, hz, iwn_watchdog, sc);
+
+	sc->fw_restarts++;
+	sc->fw_restart_ms = ((u_int)(ticks - start) * 1000) / hz;
+	IWN_UNLOCK(sc);
+
+	device_printf(sc->sc_dev, "firmware restarted in %u ms\n",
+	    sc->fw_restart_ms);
+	iwn_start(ifp);
+}
 #ifdef	IWN_DEBUG
 #define	IWN_DESC(x) case x:	return #x
 #define	COUNTOF(array) (sizeof(array) / sizeof(array[0]))
@@ -7422,37 +10113,14 @@ static void
 iwn_debug_register(struct iwn_softc *sc)
 {
 	int i;
-	static const uint32_t csr_tbl[] = {
-		IWN_HW_IF_CONFIG,
-		IWN_INT_COALESCING,
-		IWN_INT,
-		IWN_INT_MASK,
-		IWN_FH_INT,
-		IWN_GPIO_IN,
-		IWN_RESET,
-		IWN_GP_CNTRL,
-		IWN_HW_REV,
-		IWN_EEPROM,
-		IWN_EEPROM_GP,
-		IWN_OTP_GP,
-		IWN_GIO,
-		IWN_GP_UCODE,
-		IWN_GP_DRIVER,
-		IWN_UCODE_GP1,
-		IWN_UCODE_GP2,
-		IWN_LED,
-		IWN_DRAM_INT_TBL,
-		IWN_GIO_CHICKEN,
-		IWN_ANA_PLL,
-		IWN_HW_REV_WA,
-		IWN_DBG_HPET_MEM,
-	};
+
 	DPRINTF(sc, IWN_DEBUG_REGISTER,
 	    "CSR values: (2nd byte of IWN_INT_COALESCING is IWN_INT_PERIODIC)%s",
 	    "\n");
-	for (i = 0; i <  COUNTOF(csr_tbl); i++){
+	for (i = 0; i <  COUNTOF(iwn_csr_tbl); i++){
 		DPRINTF(sc, IWN_DEBUG_REGISTER,"  %10s: 0x%08x ",
-			iwn_get_csr_string(csr_tbl[i]), IWN_READ(sc, csr_tbl[i]));
+			iwn_get_csr_string(iwn_csr_tbl[i]),
+			IWN_READ(sc, iwn_csr_tbl[i]));
 		if ((i+1) % 3 == 0)
 			DPRINTF(sc, IWN_DEBUG_REGISTER,"%s","\n");
 	}
@@ -7908,6 +10576,7 @@ static int
 iwn_set_statistics_request(struct iwn_softc *sc,bool enable,bool clear,int async)
 {
 	struct iwn_statistics_cmd cmd;
+	int error;
 
 	if (enable) 
 		cmd.configuration_flags= clear ? IWN_STATS_CONF_CLEAR_STATS :0;
@@ -7917,7 +10586,10 @@ iwn_set_statistics_request(struct iwn_softc *sc,bool enable,bool clear,int async
 
 	DPRINTF(sc, IWN_DEBUG_CALIBRATE, "%s: sending request for statistics flags : 0x%x\n",
 	    __func__,cmd.configuration_flags);
-	return iwn_cmd(sc, IWN_CMD_GET_STATISTICS, &cmd, sizeof cmd, async ? 1:0);
+	error = iwn_cmd(sc, IWN_CMD_GET_STATISTICS, &cmd, sizeof cmd, async ? 1:0);
+	if (error == 0)
+		sc->fwstats_reqs++;	/* See iwn_fwstats_update(). */
+	return error;
 }
 
 static int
@@ -8104,7 +10776,7 @@ iwn_auth_u1(struct iwn_softc *sc, struct ieee80211vap *vap)
 	struct ifnet *ifp = sc->sc_ifp;
 	struct ieee80211com *ic = ifp->if_l2com;
 	struct ieee80211_node *ni = vap->iv_bss;
-	int error;
+	int error, full;
 	struct iwn_vap *ivp = IWN_VAP(vap);
 
 	DPRINTF(sc, IWN_DEBUG_TRACE, "->%s begin\n", __func__);
@@ -8137,12 +10809,17 @@ iwn_auth_u1(struct iwn_softc *sc, struct ieee80211vap *vap)
 	    sc->rxon->chan, sc->rxon->flags, sc->rxon->cck_mask,
 	    sc->rxon->ofdm_mask);
 	sc->rxon->mode = IWN_MODE_2STA;
-	error = iwn_cmd(sc, IWN_CMD_WIPAN_RXON, sc->rxon, sc->rxonsz, 0);
+	error = iwn_rxon_commit(sc, IWN_RXON_PAN_CTX, 0, &full);
 	if (error != 0) {
 		device_printf(sc->sc_dev, "%s: RXON command failed, error %d\n",
 		    __func__, error);
 		return error;
 	}
+	if (!full) {
+		/* Node table and TX power are still valid. */
+		DPRINTF(sc, IWN_DEBUG_TRACE, "->%s end\n", __func__);
+		return 0;
+	}
 
 	/* Configuration has changed, set TX power accordingly. */
 	if ((error = ops->set_txpower(sc, ni->ni_chan, 1)) != 0) {
@@ -8174,7 +10851,7 @@ iwn_run_u1(struct iwn_softc *sc, struct ieee80211vap *vap)
 	struct ieee80211_node *ni = vap->iv_bss;
 	struct iwn_node_info node;
 	uint32_t htflags = 0;
-	int error;
+	int error, full;
 	struct iwn_vap *ivp = IWN_VAP(vap);
 
 	DPRINTF(sc, IWN_DEBUG_TRACE, "->%s begin\n", __func__);
@@ -8240,7 +10917,7 @@ iwn_run_u1(struct iwn_softc *sc, struct ieee80211vap *vap)
 	DPRINTF(sc, IWN_DEBUG_STATE, "rxon chan %d flags %x\n",
 	    sc->rxon->chan, sc->rxon->flags);
 	sc->rxon->mode = IWN_MODE_2STA;
-	error = iwn_cmd(sc, IWN_CMD_WIPAN_RXON, sc->rxon, sc->rxonsz, 0);
+	error = iwn_rxon_commit(sc, IWN_RXON_PAN_CTX, 0, &full);
 	if (error != 0) {
 		device_printf(sc->sc_dev,
 		    "%s: could not update configuration, error %d\n", __func__,
@@ -8249,7 +10926,7 @@ iwn_run_u1(struct iwn_softc *sc, struct ieee80211vap *vap)
 	}
 
 	/* Configuration has changed, set TX power accordingly. */
-	if ((error = ops->set_txpower(sc, ni->ni_chan, 1)) != 0) {
+	if (full && (error = ops->set_txpower(sc, ni->ni_chan, 1)) != 0) {
 		device_printf(sc->sc_dev,
 		    "%s: could not set TX power, error %d\n", __func__, error);
 		return error;
@@ -8373,7 +11050,7 @@ iwn_config_u1(struct iwn_softc *sc)
 	sc->rxon->associd = 0;
 	sc->rxon->filter &= ~htole32(IWN_FILTER_BSS);
 
-	error = iwn_cmd(sc, IWN_CMD_WIPAN_RXON, sc->rxon, sc->rxonsz, 0);
+	error = iwn_rxon_commit(sc, IWN_RXON_PAN_CTX, 0, NULL);
 	if (error != 0) {
 		device_printf(sc->sc_dev, "%s: IWN_CMD_WIPAN_RXON command failed\n",
 		    __func__);
@@ -58,6 +58,8 @@ iwn4965_attach(struct iwn_softc *sc, uint16_t pid)
 	sc->fw_data_maxsz = IWN4965_FW_DATA_MAXSZ;
 	sc->fwsz = IWN4965_FWSZ;
 	sc->sched_txfact_addr = IWN4965_SCHED_TXFACT;
+	sc->sched_ctx_off = IWN4965_SCHED_CTX_OFF;
+	sc->sched_ctx_len = IWN4965_SCHED_CTX_LEN;
 	sc->limits = &iwn4965_sensitivity_limits;
 	sc->fwname = "iwn4965fw";
 	/* Override chains masks, ROM is known to be broken. */
@@ -531,8 +533,10 @@ iwn4965_ampdu_tx_start(struct iwn_softc *sc, struct ieee80211_node *ni,
 	iwn_prph_setbits(sc, IWN4965_SCHED_QCHAIN_SEL, 1 << qid);
 
 	/* Set starting sequence number from the ADDBA request. */
+	IWN_TXQ_LOCK(&sc->txq[qid]);
 	sc->txq[qid].cur = sc->txq[qid].read = (ssn & 0xff);
 	IWN_WRITE(sc, IWN_HBUS_TARG_WRPTR, qid << 8 | (ssn & 0xff));
+	IWN_TXQ_UNLOCK(&sc->txq[qid]);
 	iwn_prph_write(sc, IWN4965_SCHED_QUEUE_RDPTR(qid), ssn);
 
 	/* Set scheduler window size. */
@@ -579,6 +583,7 @@ iwn4965_ampdu_tx_stop(struct iwn_softc *sc, int qid, uint8_t tid, uint16_t ssn)
 static int
 iwn4965_post_alive(struct iwn_softc *sc)
 {
+	uint32_t qctx[2 * IWN4965_NTXQUEUES];
 	int error, qid;
 
 	if ((error = iwn_nic_lock(sc)) != 0)
@@ -604,13 +609,13 @@ iwn4965_post_alive(struct iwn_softc *sc)
 		IWN_WRITE(sc, IWN_HBUS_TARG_WRPTR, qid << 8 | 0);
 
 		/* Set scheduler window size. */
-		iwn_mem_write(sc, sc->sched_base +
-		    IWN4965_SCHED_QUEUE_OFFSET(qid), IWN_SCHED_WINSZ);
+		qctx[qid * 2] = IWN_SCHED_WINSZ;
 		/* Set scheduler frame limit. */
-		iwn_mem_write(sc, sc->sched_base +
-		    IWN4965_SCHED_QUEUE_OFFSET(qid) + 4,
-		    IWN_SCHED_LIMIT << 16);
+		qctx[qid * 2 + 1] = IWN_SCHED_LIMIT << 16;
 	}
+	/* Queue contexts are contiguous, write them in one burst. */
+	iwn_mem_write_region_4(sc, sc->sched_base +
+	    IWN4965_SCHED_QUEUE_OFFSET(0), qctx, nitems(qctx));
 
 	/* Enable interrupts for all our 16 queues. */
 	iwn_prph_write(sc, IWN4965_SCHED_INTR_MASK, 0xffff);
@@ -713,7 +718,7 @@ iwn4965_load_firmware(struct iwn_softc *sc)
 
 	/* Retrieve current temperature for initial TX power calibration. */
 	sc->rawtemp = sc->ucode_info.temp[3].chan20MHz;
-	sc->temp = iwn4965_get_temperature(sc);
+	sc->temp = sc->curtemp = iwn4965_get_temperature(sc);
 
 	/* Copy runtime sections into pre-allocated DMA-safe memory. */
 	memcpy(dma->vaddr, fw->main.data, fw->main.datasz);
@@ -22,6 +22,13 @@
 
 #define	IWN_CT_KILL_THRESHOLD		114	/* in Celsius */
 #define	IWN_CT_KILL_EXIT_THRESHOLD	95	/* in Celsius */
+#define	IWN_CT_KILL_EXIT_POLL		5	/* in seconds */
+
+/* Thermal throttling thresholds, crossed downwards IWN_TT_HYST lower. */
+#define	IWN_TT_LIGHT_THRESHOLD		100	/* in Celsius */
+#define	IWN_TT_MEDIUM_THRESHOLD		105	/* in Celsius */
+#define	IWN_TT_HEAVY_THRESHOLD		110	/* in Celsius */
+#define	IWN_TT_HYST			3	/* in Celsius */
 
 #define IWN_TX_RING_COUNT	256
 #define IWN_TX_RING_LOMARK	192
@@ -548,6 +555,9 @@ struct iwn_tx_cmd {
 	uint8_t	data[136];
 } __packed;
 
+/* Largest payload iwn_cmd() can send: a cluster less the 4-byte header. */
+#define IWN_CMD_MAXSZ	(MCLBYTES - 4)
+
 /*
  * Structure for IWN_CMD_GET_STATISTICS = (0x9c) 156
  * all devices identical.
@@ -654,6 +664,22 @@ struct iwn_assoc {
 	uint16_t	reserved;
 } __packed;
 
+/* Structure for command IWN_CMD_RXON_ASSOC (5000 Series and later.) */
+struct iwn5000_rxon_assoc {
+	uint32_t	flags;
+	uint32_t	filter;
+	uint8_t		ofdm_mask;
+	uint8_t		cck_mask;
+	uint16_t	reserved1;
+	uint8_t		ht_single_mask;
+	uint8_t		ht_dual_mask;
+	uint8_t		ht_triple_mask;
+	uint8_t		reserved2;
+	uint16_t	rxchain;
+	uint16_t	acquisition;
+	uint32_t	reserved3;
+} __packed;
+
 /* Structure for command IWN_CMD_EDCA_PARAMS. */
 struct iwn_edca_params {
 	uint32_t	flags;
@@ -973,6 +999,17 @@ struct iwn_scan_chan {
 
 #define	IWN_SCAN_CHAN_TIMEOUT		2
 
+/*
+ * Background scan timing, in msec.  While associated the firmware leaves
+ * the home channel for at most MAX_OUT_TIME and then goes back for
+ * SUSPEND_TIME before it visits the next channel of the command.
+ */
+#define	IWN_BGSCAN_MAX_OUT_TIME		200
+#define	IWN_BGSCAN_SUSPEND_TIME		100
+#define	IWN_BGSCAN_QUIET_TIME		5
+/* Frames pending on data rings above which a background scan waits. */
+#define	IWN_BGSCAN_BUSY_THRESHOLD	32
+
 /* Structure for command IWN_CMD_TXPOWER (4965AGN only.) */
 #define IWN_RIDX_MAX	32
 /* Structure for command IWN_CMD_TXPOWER_DBM (5000 Series only.) */
@@ -1139,6 +1176,14 @@ struct iwn_enhanced_sensitivity_cmd {
  * PS: TEMP_OFFSET count for 2 (std and v2)
  */
 #define IWN5000_PHY_CALIB_MAX_RESULT	8
+
+/*
+ * INIT firmware calibration results are reused on reinit while the device
+ * stays within the same temperature band and for at most MAXAGE seconds.
+ */
+#define IWN_CALIB_TBAND_WIDTH		10	/* in Celsius */
+#define IWN_CALIB_TBAND_UNKNOWN		(-1000)
+#define IWN_CALIB_CACHE_MAXAGE		3600
 /* Structures for command IWN_CMD_PHY_CALIB. */
 struct iwn_phy_calib {
 	uint8_t	code;
@@ -1627,6 +1672,16 @@ struct iwn_fw_dump {
 	uint32_t	time[2];
 } __packed;
 
+/* Firmware event log header, followed by ``capacity'' entries. */
+struct iwn_fw_evtlog_hdr {
+	uint32_t	capacity;
+	uint32_t	mode;
+#define IWN_EVTLOG_MODE_NOTIME	0	/* id, data; else id, time, data */
+
+	uint32_t	wraps;
+	uint32_t	next;
+} __packed;
+
 /* TLV firmware header. */
 struct iwn_fw_tlv_hdr {
 	uint32_t	zero;	/* Always 0, to differentiate from legacy. */
@@ -1672,7 +1727,12 @@ struct iwn_fw_tlv {
 #define IWN5000_FW_TEXT_MAXSZ	(256 * 1024)
 #define IWN5000_FW_DATA_MAXSZ	( 80 * 1024)
 #define IWN_FW_BOOT_TEXT_MAXSZ	1024
-#define IWN5000_FWSZ		IWN5000_FW_TEXT_MAXSZ
+/*
+ * Firmware sections are uploaded in chunks through two DMA buffers so
+ * that copying one chunk overlaps the transfer of the previous one.
+ */
+#define IWN5000_FW_CHUNKSZ	(32 * 1024)
+#define IWN5000_FWSZ		(2 * IWN5000_FW_CHUNKSZ)
 
 /*
  * Offsets into EEPROM.
@@ -2080,14 +2140,32 @@ static const char * const iwn_fw_errmsg[] = {
 /* Find least significant bit that is set. */
 #define IWN_LSB(x)	((((x) - 1) & (x)) ^ (x))
 
-#define IWN_READ(sc, reg)						\
+#ifdef IWN_DEBUG
+/* Go through the register access tracer (see iwn_reg_read()). */
+#define IWN_READ_LINE(sc, reg, line)					\
+	iwn_reg_read((sc), (reg), (line))
+
+#define IWN_WRITE_LINE(sc, reg, val, line)				\
+	iwn_reg_write((sc), (reg), (val), (line))
+
+#define IWN_WRITE_1(sc, reg, val)					\
+	iwn_reg_write_1((sc), (reg), (val), __LINE__)
+#else
+#define IWN_READ_LINE(sc, reg, line)					\
 	bus_space_read_4((sc)->sc_st, (sc)->sc_sh, (reg))
 
-#define IWN_WRITE(sc, reg, val)						\
+#define IWN_WRITE_LINE(sc, reg, val, line)				\
 	bus_space_write_4((sc)->sc_st, (sc)->sc_sh, (reg), (val))
 
 #define IWN_WRITE_1(sc, reg, val)					\
 	bus_space_write_1((sc)->sc_st, (sc)->sc_sh, (reg), (val))
+#endif
+
+#define IWN_READ(sc, reg)						\
+	IWN_READ_LINE(sc, reg, __LINE__)
+
+#define IWN_WRITE(sc, reg, val)						\
+	IWN_WRITE_LINE(sc, reg, val, __LINE__)
 
 #define IWN_SETBITS(sc, reg, mask)					\
 	IWN_WRITE(sc, reg, IWN_READ(sc, reg) | (mask))
@@ -58,6 +58,8 @@
 #define IWN4965_FW_DATA_MAXSZ	( 40 * 1024)
 #define IWN4965_FWSZ		(IWN4965_FW_TEXT_MAXSZ + IWN4965_FW_DATA_MAXSZ)
 
+#define IWN4965_EEPROM_SIZE	1024	/* bytes */
+
 #define IWN4965_EEPROM_DOMAIN	0x060
 #define IWN4965_EEPROM_BAND1	0x063
 #define IWN4965_EEPROM_BAND2	0x072
@@ -96,14 +96,27 @@ struct iwn_dma_info {
 	bus_size_t		size;
 };
 
+/*
+ * Per-slot state needed on completion only; the physical addresses of
+ * the slot's TX command and scratch area follow from its index.
+ */
 struct iwn_tx_data {
-	bus_dmamap_t		map;
-	bus_addr_t		cmd_paddr;
-	bus_addr_t		scratch_paddr;
 	struct mbuf		*m;
 	struct ieee80211_node	*ni;
+	bus_dmamap_t		map;
 };
 
+/*
+ * Ring telemetry histograms use power-of-2 buckets: 0, 1, 2-3, ..., 128+.
+ */
+#define IWN_RING_HIST		9
+
+/* ICT entries per host cache line; the table is page aligned. */
+#define IWN_ICT_PER_LINE	(CACHE_LINE_SIZE / sizeof (uint32_t))
+
+/* Free an unused aggregation ring after this many idle minutes. */
+#define IWN_TXQ_IDLE_FREE	2
+
 struct iwn_tx_ring {
 	struct iwn_dma_info	desc_dma;
 	struct iwn_dma_info	cmd_dma;
@@ -112,11 +125,27 @@ struct iwn_tx_ring {
 	struct iwn_tx_data	data[IWN_TX_RING_COUNT];
 	bus_dma_tag_t		data_dmat;
 	int			qid;
-	int			queued;
-	int			cur;
-	int			read;
+	int			queued;	/* atomic */
+	int			cur;	/* producer only */
+	int			read;	/* consumer only */
+	struct mtx		mtx;	/* ring resets, command ring */
+	int			idle;	/* minutes without a BA session */
+
+	/* Telemetry, exported under dev.iwn.N.txq.<qid>. */
+	uint64_t		st_queued;
+	uint64_t		st_done;
+	int			st_hiwat;
+	uint32_t		st_full;	/* qfullmsk set transitions */
+	int			st_full_since;	/* ticks */
+	uint64_t		st_full_ticks;	/* time marked full (qfullmsk) */
+	uint64_t		st_occ[IWN_RING_HIST];	  /* queued at enqueue */
+	uint64_t		st_reclaim[IWN_RING_HIST]; /* frames per completion */
 };
 
+#define IWN_TX_CMD_PADDR(ring, idx)					\
+	((ring)->cmd_dma.paddr + (idx) * sizeof (struct iwn_tx_cmd))
+#define IWN_TX_SCRATCH_PADDR(ring, idx)	(IWN_TX_CMD_PADDR(ring, idx) + 12)
+
 struct iwn_softc;
 
 struct iwn_rx_data {
@@ -132,6 +161,12 @@ struct iwn_rx_ring {
 	struct iwn_rx_data	data[IWN_RX_RING_COUNT];
 	bus_dma_tag_t		data_dmat;
 	int			cur;
+
+	/* Telemetry, exported under dev.iwn.N.rxq. */
+	uint64_t		st_desc;
+	uint32_t		st_full;	/* passes finding the ring full */
+	uint32_t		st_nombuf;	/* RX buffer allocation failures */
+	uint64_t		st_batch[IWN_RING_HIST]; /* descriptors per pass */
 };
 
 struct iwn_node {
@@ -145,6 +180,25 @@ struct iwn_node {
 	} agg[IEEE80211_TID_SIZE];
 };
 
+/*
+ * Maximum over a sliding window of samples, kept as a monotonic deque:
+ * the samples still in the window that no later sample exceeds, oldest
+ * (and largest) first.  Each sample is queued and dropped at most once,
+ * so updates are O(1) amortized.  A zeroed structure is an empty window.
+ */
+#define IWN_SWMAX_SIZE		32	/* Must be a power of 2. */
+
+struct iwn_swmax {
+	uint32_t	val[IWN_SWMAX_SIZE];
+	uint32_t	seq[IWN_SWMAX_SIZE];
+	u_int		head;
+	u_int		count;
+	uint32_t	nsamples;
+};
+
+#define IWN_CALIB_NOISE_WINDOW	20	/* beacons */
+#define IWN_CALIB_ENERGY_WINDOW	10	/* beacons */
+
 struct iwn_calib_state {
 	uint8_t		state;
 #define IWN_CALIB_STATE_INIT	0
@@ -170,11 +224,9 @@ struct iwn_calib_state {
 #define IWN_CCK_STATE_LOFA	1
 #define IWN_CCK_STATE_HIFA	2
 
-	uint8_t		noise_samples[20];
-	u_int		cur_noise_sample;
+	struct iwn_swmax	noise_max;
 	uint8_t		noise_ref;
-	uint32_t	energy_samples[10];
-	u_int		cur_energy_sample;
+	struct iwn_swmax	energy_max;
 	uint32_t	energy_cck;
 
 	uint32_t	corr_barker_mrc;
@@ -186,6 +238,198 @@ struct iwn_calib_info {
 	u_int		len;
 };
 
+/*
+ * Code paths register accesses are accounted to (see iwn_regpath_enter()).
+ */
+enum iwn_regpath {
+	IWN_REGPATH_OTHER,
+	IWN_REGPATH_INTR,
+	IWN_REGPATH_TX,
+	IWN_REGPATH_INIT,
+	IWN_REGPATH_POST_ALIVE,
+	IWN_REGPATH_STOP,
+	IWN_REGPATH_CALIB,
+	IWN_REGPATH_EEPROM,
+	IWN_REGPATH_MAX
+};
+
+/* Path tag of one thread, see iwn_regpath_enter(). */
+#define IWN_REGPATH_SLOTS	4
+
+struct iwn_regpath_slot {
+	struct thread	*td;		/* owner, NULL if free */
+	int		path;
+};
+
+struct iwn_regstat {
+	uint64_t	reads;
+	uint64_t	writes;
+	uint64_t	read_cycles;	/* CPU cycles stalled in MMIO reads */
+	uint64_t	prph;		/* Periphery register accesses */
+	uint64_t	mem;		/* SRAM word accesses */
+};
+
+/*
+ * Register access trace record, as exported by the regtrace_buf sysctl
+ * (oldest first).  ``line'' is the source line of the caller in if_iwn.c
+ * (or if_iwn4965.c), also for accesses made through the PRPH and SRAM
+ * helpers.
+ */
+#define IWN_REGTRACE_COUNT	8192	/* Must be a power of 2. */
+
+struct iwn_regtrace_ent {
+	uint64_t	tsc;
+	uint32_t	addr;
+	uint32_t	val;
+	uint16_t	line;
+	uint8_t		op;
+#define IWN_REGTRACE_READ	0
+#define IWN_REGTRACE_WRITE	1
+#define IWN_REGTRACE_WRITE_1	2
+#define IWN_REGTRACE_PRPH_READ	3
+#define IWN_REGTRACE_PRPH_WRITE	4
+#define IWN_REGTRACE_MEM_READ	5
+#define IWN_REGTRACE_MEM_WRITE	6
+
+	uint8_t		path;
+	uint32_t	reserved;
+};
+
+/*
+ * Binary event trace, as exported by the trace_buf sysctl (oldest first).
+ * Meant for the RX/TX hot paths, where printf-based DPRINTF is too slow.
+ */
+#define IWN_TRACE_COUNT		4096	/* Must be a power of 2. */
+
+struct iwn_trace_ent {
+	uint64_t	tsc;
+	uint16_t	id;
+	uint16_t	cpu;
+	uint32_t	arg[3];
+};
+
+enum {
+	IWN_EV_INTR = 1,	/* r1, r2 */
+	IWN_EV_RX_DESC,		/* qid << 16 | idx, type, len */
+	IWN_EV_RX,		/* len, rate, rssi */
+	IWN_EV_RX_BADFCS,	/* flags */
+	IWN_EV_RX_SHORT,	/* len */
+	IWN_EV_TX,		/* qid << 16 | idx, len, nsegs */
+	IWN_EV_TX_DONE,		/* qid << 16 | idx, rate, status | retries << 16 */
+	IWN_EV_TX_STATUS	/* qid << 16 | idx, status, ackfailcnt */
+};
+
+/*
+ * Firmware event log records, as read from /dev/iwnN.evtlog.  ``seq''
+ * numbers every entry the firmware logged, so a gap means entries were
+ * lost, either overwritten in SRAM or dropped because the reader was
+ * too slow.
+ */
+#define IWN_EVTLOG_COUNT	1024	/* Must be a power of 2. */
+#define IWN_EVTLOG_BATCH	128	/* SRAM entries read per poll. */
+#define IWN_EVTLOG_INTERVAL	100	/* msec between polls. */
+
+struct iwn_evtlog_ent {
+	uint64_t	tsc;		/* host cycle count when collected */
+	uint32_t	seq;
+	uint32_t	id;
+	uint32_t	time;		/* firmware time, 0 if not logged */
+	uint32_t	data;
+};
+
+/* Thermal throttling states, see iwn_tt_update(). */
+enum {
+	IWN_TT_NORMAL,
+	IWN_TT_LIGHT,
+	IWN_TT_MEDIUM,
+	IWN_TT_HEAVY,
+	IWN_TT_CTKILL		/* RF stopped by the firmware */
+};
+
+/* Commands kept in the history included in crash dumps. */
+#define IWN_CMD_HIST		32	/* Must be a power of 2. */
+
+struct iwn_cmd_rec {
+	uint64_t	tsc;
+	uint8_t		code;
+	uint8_t		qid;
+	uint8_t		idx;
+	uint8_t		async;
+	uint16_t	len;
+	uint16_t	reserved;
+};
+
+/*
+ * Post-mortem snapshot taken on a firmware error, exported through the
+ * crashdump sysctl.  It is captured into a buffer allocated at attach
+ * time; nothing is allocated from the interrupt handler.
+ */
+#define IWN_CRASH_MAGIC		0x43776e69	/* "iwnC" */
+#define IWN_CRASH_VERSION	1
+#define IWN_CRASH_NCSR		23	/* iwn_csr_tbl[] */
+#define IWN_CRASH_EVENTS	256	/* most recent event log entries */
+
+struct iwn_crash_txq {
+	uint16_t	cur;
+	uint16_t	read;
+	uint16_t	queued;
+	uint16_t	flags;
+#define IWN_CRASH_TXQ_ALLOC	0x0001
+#define IWN_CRASH_TXQ_AGG	0x0002
+};
+
+struct iwn_crashdump {
+	uint32_t		magic;
+	uint32_t		version;
+	uint32_t		size;		/* of this structure */
+	uint32_t		fw_ver;
+	uint64_t		tsc;
+	uint64_t		uptime;		/* seconds */
+	uint32_t		hw_type;
+	uint32_t		flags;
+#define IWN_CRASH_ERRLOG	0x0001		/* error[] is valid */
+#define IWN_CRASH_SRAM		0x0002		/* sched[] and events valid */
+
+	struct iwn_fw_dump	error;
+	uint32_t		csr[IWN_CRASH_NCSR];
+	uint32_t		sched_len;	/* words used in sched[] */
+	uint32_t		sched[IWN5000_SCHED_CTX_LEN / 4];
+	struct iwn_fw_evtlog_hdr evthdr;
+	uint32_t		evtesz;		/* words per event entry */
+	uint32_t		nevents;	/* oldest first */
+	uint32_t		events[IWN_CRASH_EVENTS * 3];
+	uint32_t		rxcur;
+	uint32_t		ntxqs;
+	struct iwn_crash_txq	txq[IWN5000_NTXQUEUES];
+	uint32_t		ncmds;		/* oldest first */
+	struct iwn_cmd_rec	cmds[IWN_CMD_HIST];
+};
+
+/* Largest ROM image kept in RAM (lower OTP blocks, or EEPROM). */
+#define IWN_EEPROM_SHADOW_SZ	OTP_LOW_IMAGE_SIZE
+
+/*
+ * Calibration cache as exported through the calib_cache sysctl: a header
+ * followed by ``nentries'' records, each followed by ``len'' bytes of
+ * IWN_CMD_PHY_CALIB payload.  Fields are in host byte order.
+ */
+#define IWN_CALIB_BLOB_MAGIC	0x69776e63	/* "iwnc" */
+#define IWN_CALIB_BLOB_MAXSZ	(16 * 1024)
+
+struct iwn_calib_blob_hdr {
+	uint32_t	magic;
+	uint32_t	fwver;
+	int32_t		tband;
+	uint8_t		hw_type;
+	uint8_t		nentries;
+	uint16_t	reserved;
+} __packed;
+
+struct iwn_calib_blob_ent {
+	uint16_t	idx;
+	uint16_t	len;
+} __packed;
+
 struct iwn_fw_part {
 	const uint8_t	*text;
 	uint32_t	textsz;
@@ -260,7 +504,84 @@ struct iwn_softc {
 	struct ifnet		*sc_ifp;
 	int			sc_debug;
 
+	/*
+	 * Lock order: sc_mtx -> sc_rx_mtx -> sc_tx_mtx -> txq[].mtx.
+	 * sc_mtx covers the softc state, firmware commands and the
+	 * interrupt handler; sc_tx_mtx serializes the TX producers and
+	 * IFF_DRV_OACTIVE; data rings are single-producer/single-consumer
+	 * and need no lock of their own, the ring lock only covers resets
+	 * and the command ring; sc_rx_mtx is held while walking the RX ring.
+	 */
 	struct mtx		sc_mtx;
+	struct mtx		sc_tx_mtx;
+	struct mtx		sc_rx_mtx;
+
+	/*
+	 * Firmware statistics, one slot per 32-bit word of struct
+	 * iwn_stats: 64-bit running totals for counters (last value for
+	 * gauges) and the raw value last reported by the firmware.
+	 */
+	uint64_t		fwstats[sizeof (struct iwn_stats) / 4];
+	uint32_t		fwstats_last[sizeof (struct iwn_stats) / 4];
+	int			fwstats_clear;
+	int			fwstats_clear_pending;
+	/*
+	 * Statistics requests sent and replies received since the firmware
+	 * started; replies come back in order, so the clearing request is
+	 * matched to its reply by number (fwstats_clear_seq).
+	 */
+	uint32_t		fwstats_reqs;
+	uint32_t		fwstats_replies;
+	uint32_t		fwstats_clear_seq;
+
+	/* Binary event trace, enabled through the trace sysctl. */
+	struct iwn_trace_ent	*sc_trace;
+	u_int			sc_trace_cur;
+
+	/* Recent commands and the last crash dump. */
+	struct iwn_cmd_rec	cmdhist[IWN_CMD_HIST];
+	u_int			cmdhist_cur;
+	struct iwn_crashdump	*crash;
+	uint32_t		crashes;
+
+	/* Firmware event log, collected while the evtlog device is open. */
+	struct cdev		*sc_evtdev;
+	struct callout		evtlog_to;
+	struct iwn_evtlog_ent	*evtlog;	/* host ring */
+	uint32_t		*evtlog_buf;	/* SRAM read buffer */
+	u_int			evtlog_prod;
+	u_int			evtlog_cons;
+	uint32_t		evtlog_seq;
+	uint32_t		evtlog_ptr;	/* from the alive notification */
+	uint32_t		evtlog_fwptr;	/* from the firmware TLVs */
+	uint32_t		evtlog_fwsize;
+	uint32_t		evtlog_wraps;	/* SRAM position read so far */
+	uint32_t		evtlog_next;
+	int			evtlog_interval;
+	int			evtlog_gone;
+	uint64_t		evtlog_events;
+	uint64_t		evtlog_lost;
+
+	/* Register access accounting and trace (IWN_DEBUG only). */
+	struct iwn_regpath_slot	regpath[IWN_REGPATH_SLOTS];
+	struct iwn_regstat	regstat[IWN_REGPATH_MAX];
+	struct iwn_regtrace_ent	*regtrace;
+	u_int			regtrace_cur;
+
+	/* RAM copy of the EEPROM/OTPROM image, read once at attach. */
+	uint8_t			eeprom_shadow[IWN_EEPROM_SHADOW_SZ];
+	int			eeprom_shadow_len;
+	uint32_t		eeprom_shadow_hits;
+
+	/* NIC access (MAC_ACCESS_REQ) nesting and statistics. */
+	int			nic_awake;
+	int			nic_ref;
+	int			nic_batch;
+	uint32_t		nic_wakes;
+	uint32_t		nic_nested;
+	uint32_t		nic_spins;
+	uint32_t		nic_timeouts;
+	uint32_t		nic_maxwait;
 
 	u_int			sc_flags;
 #define IWN_FLAG_HAS_OTPROM	(1 << 1)
@@ -271,6 +592,8 @@ struct iwn_softc {
 #define IWN_FLAG_ENH_SENS	(1 << 7)
 #define IWN_FLAG_ADV_BTCOEX	(1 << 8)
 #define IWN_FLAG_PAN_SUPPORT	(1 << 9)
+#define IWN_FLAG_FW_LOADING	(1 << 10)
+#define IWN_FLAG_PHY_CALIB_TLV	(1 << 11)
 
 	uint8_t 		hw_type;
 	/* subdevice_id used to adjust configuration */
@@ -290,6 +613,8 @@ struct iwn_softc {
 	uint32_t		fw_data_maxsz;
 	uint32_t		fwsz;
 	bus_size_t		sched_txfact_addr;
+	uint32_t		sched_ctx_off;
+	uint32_t		sched_ctx_len;
 	uint32_t		reset_noise_gain;
 	uint32_t		noise_gain;
 
@@ -301,16 +626,25 @@ struct iwn_softc {
 	/* "Keep Warm" page. */
 	struct iwn_dma_info	kw_dma;
 
-	/* Firmware image. */
+	/* Firmware image, cached until detach. */
 	const struct firmware	*fw_fp;
+	uint32_t		fw_ver;
+	uint32_t		fw_loads;
+	uint32_t		fw_cache_hits;
+	uint32_t		fw_restarts;
+	uint32_t		fw_restart_fails;
+	u_int			fw_restart_ms;
 
 	/* Firmware DMA transfer. */
 	struct iwn_dma_info	fw_dma;
+	int			fw_dma_done;
 
 	/* ICT table. */
 	struct iwn_dma_info	ict_dma;
 	uint32_t		*ict;
 	int			ict_cur;
+	uint64_t		ict_hist[IWN_RING_HIST]; /* entries per intr */
+	uint32_t		ict_overflows;	/* table lapped, used IWN_INT */
 
 	/* TX/RX rings. */
 	struct iwn_tx_ring	txq[IWN5000_NTXQUEUES];
@@ -328,8 +662,10 @@ struct iwn_softc {
 
 	/* Tasks used by the driver */
 	struct task		sc_reinit_task;
+	struct task		sc_restart_task;
 	struct task		sc_radioon_task;
 	struct task		sc_radiooff_task;
+	struct task		sc_txqfree_task;
 
 	struct callout		calib_to;
 	int			calib_cnt;
@@ -338,19 +674,32 @@ struct iwn_softc {
 	struct callout		ct_kill_exit_to;
 	struct iwn_fw_info	fw;
 	struct iwn_calib_info	calibcmd[IWN5000_PHY_CALIB_MAX_RESULT];
+	/* Key and age of the results in calibcmd[]. */
+	uint32_t		calib_fwver;
+	int			calib_tband;
+	time_t			calib_stamp;
+	uint32_t		calib_reused;
+	uint32_t		calib_stale;
 	uint32_t		errptr;
 
 	struct iwn_rx_stat	last_rx_stat;
 	int			last_rx_valid;
 	struct iwn_ucode_info	ucode_info;
 	struct iwn_rxon		rx_on[IWN_NUM_RXON_CTX];
+	/* Last RXON accepted by the firmware, valid if bit set. */
+	struct iwn_rxon		rx_on_active[IWN_NUM_RXON_CTX];
+	uint32_t		rxon_valid;
+	uint32_t		rxon_full_cnt;
+	uint32_t		rxon_assoc_cnt;
+	uint32_t		rxon_skip_cnt;
 	struct iwn_rxon		*rxon;
 	int			ctx;
 	struct ieee80211vap	*ivap[IWN_NUM_RXON_CTX];
 
 	uint8_t			uc_scan_progress;
 	uint32_t		rawtemp;
-	int			temp;
+	int			temp;		/* 4965: at last TX power calib */
+	int			curtemp;	/* last reading, in degC */
 	int			noise;
 	uint32_t		qfullmsk;
 
@@ -384,7 +733,23 @@ struct iwn_softc {
 	int			sc_tx_timer;
 	int			sc_scan_timer;
 
+	/* Background scan tunables and counters. */
+	int			bgscan_maxout;
+	int			bgscan_suspend;
+	int			bgscan_busythr;
+	uint32_t		bgscan_cmds;
+	uint32_t		bgscan_deferred;
+
 	struct ieee80211_tx_ampdu *qid2tap[IWN5000_NTXQUEUES];
+	/*
+	 * Aggregation rings are only allocated when a BA session first
+	 * needs them and freed again after IWN_TXQ_IDLE_FREE minutes
+	 * without one; txq_freeing marks rings being released.
+	 */
+	uint32_t		txq_freeing;
+	int			txq_idle_ticks;	/* seconds, see iwn_watchdog() */
+	uint32_t		txq_allocs;
+	uint32_t		txq_frees;
 
 	int			(*sc_ampdu_rx_start)(struct ieee80211_node *,
 				    struct ieee80211_rx_ampdu *, int, int, int);
@@ -411,6 +776,11 @@ struct iwn_softc {
 	 */
 	int			current_pwrsave_level;
 
+	/* Thermal throttling. */
+	int			tt_state;
+	uint32_t		tt_transitions;
+	uint32_t		ct_kills;
+
 	/* For specifique params */
 	struct iwn_base_params *base_params;
 };
@@ -422,3 +792,21 @@ struct iwn_softc {
 #define IWN_LOCK_ASSERT(_sc)		mtx_assert(&(_sc)->sc_mtx, MA_OWNED)
 #define IWN_UNLOCK(_sc)			mtx_unlock(&(_sc)->sc_mtx)
 #define IWN_LOCK_DESTROY(_sc)		mtx_destroy(&(_sc)->sc_mtx)
+
+#define IWN_TX_LOCK_INIT(_sc) \
+	mtx_init(&(_sc)->sc_tx_mtx, "iwn tx", NULL, MTX_DEF)
+#define IWN_TX_LOCK(_sc)		mtx_lock(&(_sc)->sc_tx_mtx)
+#define IWN_TX_LOCK_ASSERT(_sc)		mtx_assert(&(_sc)->sc_tx_mtx, MA_OWNED)
+#define IWN_TX_UNLOCK(_sc)		mtx_unlock(&(_sc)->sc_tx_mtx)
+#define IWN_TX_LOCK_DESTROY(_sc)	mtx_destroy(&(_sc)->sc_tx_mtx)
+
+#define IWN_RX_LOCK_INIT(_sc) \
+	mtx_init(&(_sc)->sc_rx_mtx, "iwn rx", NULL, MTX_DEF)
+#define IWN_RX_LOCK(_sc)		mtx_lock(&(_sc)->sc_rx_mtx)
+#define IWN_RX_LOCK_ASSERT(_sc)		mtx_assert(&(_sc)->sc_rx_mtx, MA_OWNED)
+#define IWN_RX_UNLOCK(_sc)		mtx_unlock(&(_sc)->sc_rx_mtx)
+#define IWN_RX_LOCK_DESTROY(_sc)	mtx_destroy(&(_sc)->sc_rx_mtx)
+
+#define IWN_TXQ_LOCK(_ring)		mtx_lock(&(_ring)->mtx)
+#define IWN_TXQ_LOCK_ASSERT(_ring)	mtx_assert(&(_ring)->mtx, MA_OWNED)
+#define IWN_TXQ_UNLOCK(_ring)		mtx_unlock(&(_ring)->mtx)